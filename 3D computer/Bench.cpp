@@ -0,0 +1,147 @@
+// Imagine++ project
+// Project:  Bench
+// Run the headless builds of Seeds, GCDisparity, Fundamental and Panorama on
+// the bundled images and report wall time, throughput of each stage and peak
+// RSS of each run as JSON, to track regressions.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// A headless program with its arguments
+struct Run {
+    string program;
+    vector<string> args;
+};
+
+// Directory of this source file, where the bundled images are
+static string sourceDir() {
+    string f = __FILE__;
+    size_t p = f.rfind('/');
+    return (p==string::npos)? string("."): f.substr(0,p);
+}
+
+// Execute program with arguments, its output discarded. Return its exit
+// status (-1 if it could not run), with wall time and peak RSS in kB.
+static int execute(const string& path, const vector<string>& args,
+                   double& seconds, long& rss) {
+    vector<char*> argv;
+    argv.push_back(const_cast<char*>(path.c_str()));
+    for(size_t i=0; i<args.size(); i++)
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(0);
+
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if(pid < 0)
+        return -1;
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execv(path.c_str(), &argv[0]);
+        _exit(127);
+    }
+    int status=0;
+    struct rusage u;
+    if(wait4(pid, &status, 0, &u) < 0)
+        return -1;
+    chrono::duration<double> dt = chrono::steady_clock::now()-t0;
+    seconds = dt.count();
+    rss = u.ru_maxrss;
+    return WIFEXITED(status)? WEXITSTATUS(status): -1;
+}
+
+// Content of text file without trailing newline ("null" if absent)
+static string readJSON(const string& fileName) {
+    ifstream f(fileName.c_str());
+    stringstream s;
+    s << f.rdbuf();
+    string str = s.str();
+    while(!str.empty() && (str.back()=='\n' || str.back()==' '))
+        str.pop_back();
+    return str.empty()? string("null"): str;
+}
+
+int main(int argc, char* argv[]) {
+    string bin=".";          // Directory of headless executables
+    string data=sourceDir(); // Directory of images
+    string outFile;          // JSON report (empty: standard output)
+    for(int a=1; a<argc; a++) {
+        string opt(argv[a]);
+        if(opt.compare(0,6,"--bin=")==0)
+            bin = opt.substr(6);
+        else if(opt.compare(0,7,"--data=")==0)
+            data = opt.substr(7);
+        else if(opt.compare(0,6,"--out=")==0)
+            outFile = opt.substr(6);
+        else {
+            cerr << "Usage: " << argv[0]
+                 << " [--bin=dir] [--data=dir] [--out=file]" << endl;
+            return 1;
+        }
+    }
+    char tmp[] = "/tmp/benchXXXXXX";
+    if(! mkdtemp(tmp)) {
+        cerr << "Unable to create temporary directory" << endl;
+        return 1;
+    }
+    const string dir(tmp); // Output images and reports of programs
+
+    vector<Run> runs;
+    Run seeds = {"Seeds", {"--out="+dir, data+"/seeds1.jpg",
+                           data+"/seeds2.jpg", "-30", "-7"}};
+    Run gc = {"GCDisparity", {"--out="+dir, data+"/seeds1.jpg",
+                              data+"/seeds2.jpg", "-30", "-7"}};
+    Run fundamental = {"Fundamental", {"--out="+dir+"/F.txt",
+                                       data+"/fundamental1.jpg",
+                                       data+"/fundamental2.jpg"}};
+    Run panorama = {"Panorama", {"--points="+data+"/panorama_points.txt",
+                                 "--out="+dir+"/panorama.png",
+                                 data+"/panorama1.jpg",
+                                 data+"/panomara2.jpg"}};
+    runs.push_back(seeds);
+    runs.push_back(gc);
+    runs.push_back(fundamental);
+    runs.push_back(panorama);
+
+    stringstream json;
+    json << "{\"outputs\": \"" << dir << "\", \"runs\": [";
+    for(size_t i=0; i<runs.size(); i++) {
+        const string report = dir+"/"+runs[i].program+".json";
+        vector<string> args = runs[i].args;
+        args.insert(args.begin(), "--json="+report);
+        cerr << runs[i].program << "... " << flush;
+        double seconds=0;
+        long rss=0;
+        int status = execute(bin+"/"+runs[i].program+"_headless", args,
+                             seconds, rss);
+        cerr << (status==0? "done": "failed") << endl;
+        json << (i? ", ": "") << "{\"program\": \"" << runs[i].program
+             << "\", \"status\": " << status
+             << ", \"wall_seconds\": " << seconds
+             << ", \"peak_rss_kb\": " << rss
+             << ", \"report\": " << readJSON(report) << "}";
+    }
+    json << "]}" << endl;
+
+    if(outFile.empty())
+        cout << json.str();
+    else {
+        ofstream f(outFile.c_str());
+        f << json.str();
+        if(! f) {
+            cerr << "Error writing " << outFile << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
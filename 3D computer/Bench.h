@@ -0,0 +1,65 @@
+// Imagine++ project
+// Stage timings of the 3D computer vision programs, written as JSON so that
+// runs can be compared (see Bench.cpp).
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+/// Peak resident set size of the process in kB
+inline long peakRSS() {
+    struct rusage u;
+    getrusage(RUSAGE_SELF, &u);
+    return u.ru_maxrss;
+}
+
+/// Wall-clock time of the successive stages of a program
+class BenchReport {
+public:
+    explicit BenchReport(const std::string& program0): program(program0) {}
+    /// Start a new stage. Its work, e.g. pixels x disparities, gives the
+    /// throughput (0 if not relevant).
+    void start(const std::string& name, double work=0) {
+        Stage s = {name, 0, work};
+        stages.push_back(s);
+        t0 = std::chrono::steady_clock::now();
+    }
+    /// Set work of last stage, when only known at its end.
+    void setWork(double work) { stages.back().work = work; }
+    /// End current stage.
+    void stop() {
+        std::chrono::duration<double> dt = std::chrono::steady_clock::now()-t0;
+        stages.back().seconds = dt.count();
+    }
+    /// Write report as JSON, return false if the file cannot be written.
+    bool write(const std::string& fileName) const {
+        std::ofstream f(fileName.c_str());
+        f << "{\"program\": \"" << program << "\", \"stages\": [";
+        for(size_t i=0; i<stages.size(); i++) {
+            const Stage& s = stages[i];
+            f << (i? ", ": "") << "{\"name\": \"" << s.name
+              << "\", \"seconds\": " << s.seconds;
+            if(s.work > 0)
+                f << ", \"work\": " << s.work
+                  << ", \"throughput\": " << (s.seconds>0? s.work/s.seconds: 0);
+            f << "}";
+        }
+        f << "], \"peak_rss_kb\": " << peakRSS() << "}" << std::endl;
+        return bool(f);
+    }
+private:
+    struct Stage {
+        std::string name;
+        double seconds, work;
+    };
+    std::string program;
+    std::vector<Stage> stages;
+    std::chrono::steady_clock::time_point t0;
+};
+
+#endif
@@ -0,0 +1,147 @@
+// Imagine++ project
+// Project:  Panorama
+// Blending of the images of a panorama where they overlap, pixel by pixel in
+// the same pass as the warp:
+// - geometric mean of colors, by SSE or AVX2 square roots on runs of pixels
+//   (selected at runtime), exactly as the scalar byte(sqrt(a*b));
+// - feathering: mean weighted by the distance to the border of each image,
+//   which is the distance transform of its (rectangular) domain, computed
+//   analytically from the source point so that no map is stored.
+
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <Imagine/Images.h>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BLEND_X86
+#endif
+
+namespace Blend {
+
+using Imagine::Color;
+using Imagine::byte;
+
+enum Mode { MEAN, FEATHER };
+
+/// Geometric means out[j] = byte(sqrt(a[j]*b[j])) of n bytes (color channels)
+typedef void (*MeanKernel)(const byte* a, const byte* b, int n, byte* out);
+
+inline void meanScalar(const byte* a, const byte* b, int n, byte* out) {
+    for(int j=0; j<n; j++)
+        out[j] = byte(std::sqrt(float(int(a[j])*int(b[j]))));
+}
+
+#ifdef BLEND_X86
+__attribute__((target("sse2")))
+inline void meanSSE(const byte* a, const byte* b, int n, byte* out) {
+    const __m128i zero = _mm_setzero_si128();
+    int j=0;
+    for(; j+8<=n; j+=8) {
+        const __m128i a16 = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a+j)), zero);
+        const __m128i b16 = _mm_unpacklo_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b+j)), zero);
+        const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a16,zero),
+                                          _mm_unpacklo_epi16(b16,zero));
+        const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a16,zero),
+                                          _mm_unpackhi_epi16(b16,zero));
+        const __m128i r0 = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(lo)));
+        const __m128i r1 = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(hi)));
+        const __m128i r = _mm_packus_epi16(_mm_packs_epi32(r0,r1), zero);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out+j), r);
+    }
+    meanScalar(a+j, b+j, n-j, out+j);
+}
+
+__attribute__((target("avx2")))
+inline void meanAVX2(const byte* a, const byte* b, int n, byte* out) {
+    int j=0;
+    for(; j+16<=n; j+=16) {
+        const __m256i a0 = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a+j)));
+        const __m256i b0 = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b+j)));
+        const __m256i a1 = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a+j+8)));
+        const __m256i b1 = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b+j+8)));
+        const __m256 p0 = _mm256_sqrt_ps(_mm256_cvtepi32_ps(
+                                             _mm256_mullo_epi32(a0,b0)));
+        const __m256 p1 = _mm256_sqrt_ps(_mm256_cvtepi32_ps(
+                                             _mm256_mullo_epi32(a1,b1)));
+        // Pack to 16 then 8 bits, restoring the order of the 128-bit lanes
+        const __m256i r16 = _mm256_permute4x64_epi64(
+            _mm256_packs_epi32(_mm256_cvttps_epi32(p0),
+                               _mm256_cvttps_epi32(p1)), 0xD8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out+j),
+                         _mm_packus_epi16(_mm256_castsi256_si128(r16),
+                                          _mm256_extracti128_si256(r16,1)));
+    }
+    meanSSE(a+j, b+j, n-j, out+j);
+}
+#endif
+
+/// Best geometric mean kernel for this CPU
+inline MeanKernel meanKernel() {
+#ifdef BLEND_X86
+    if(__builtin_cpu_supports("avx2"))
+        return meanAVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return meanSSE;
+#endif
+    return meanScalar;
+}
+
+/// Geometric mean of colors a[i] and b[i], channel by channel, for i in [0,n)
+inline void geometricMean(const Color* a, const Color* b, int n, Color* out) {
+    static const MeanKernel k = meanKernel();
+    k(reinterpret_cast<const byte*>(a), reinterpret_cast<const byte*>(b), 3*n,
+      reinterpret_cast<byte*>(out));
+}
+
+/// Geometric mean of two colors, channel by channel
+inline Color geometricMean(const Color& a, const Color& b) {
+    Color c;
+    meanScalar(&a[0], &b[0], 3, &c[0]);
+    return c;
+}
+
+/// Weight of point (u,v) of a w x h image: distance to its border plus one, so
+/// that it is positive inside the image.
+inline float borderWeight(float u, float v, int w, int h) {
+    return std::min(std::min(u, w-1-u), std::min(v, h-1-v)) + 1;
+}
+
+/// Feathering of colors a[i] and b[i] of weights wa[i]>0 and wb[i]>=0, for i
+/// in [0,n): pixels of weight wb[i]=0 keep color a[i].
+inline void feather(const Color* a, const float* wa,
+                    const Color* b, const float* wb, int n, Color* out) {
+    for(int i=0; i<n; i++) {
+        const float t = wb[i]/(wa[i]+wb[i]);
+        for(int k=0; k<3; k++)
+            out[i][k] = byte(a[i][k] + t*(int(b[i][k])-int(a[i][k])) + 0.5f);
+    }
+}
+
+/// Weighted sum of colors and sum of weights
+struct Accumulator {
+    float r, g, b, sum;
+    Accumulator(): r(0), g(0), b(0), sum(0) {}
+    void add(const Color& c, float w) {
+        r += w*c[0]; g += w*c[1]; b += w*c[2];
+        sum += w;
+    }
+    /// Weighted mean; sum must be positive.
+    Color mean() const {
+        const float s = 1/sum;
+        return Color(byte(r*s+0.5f), byte(g*s+0.5f), byte(b*s+0.5f));
+    }
+};
+
+} // namespace Blend
+
+#endif
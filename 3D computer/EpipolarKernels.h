@@ -0,0 +1,134 @@
+// Imagine++ project
+// Project:  Fundamental
+// Inlier counting of RANSAC, matches being stored as structure of arrays.
+// A match is an inlier of F if point 2 is at distance less than d from the
+// epipolar line l=F^T x1, tested as (l.x2)^2 < d^2 (lx^2+ly^2) without square
+// root. AVX (8 matches per instruction) and SSE (4) versions are selected at
+// runtime, with a scalar fallback; all give the same result.
+
+#ifndef EPIPOLARKERNELS_H
+#define EPIPOLARKERNELS_H
+
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define EPIPOLAR_KERNELS_X86
+#endif
+
+namespace EpipolarKernels {
+
+/// Point matches (x1,y1) <-> (x2,y2), one array per coordinate
+struct MatchBuffer {
+    std::vector<float> x1, y1, x2, y2;
+    int size() const { return int(x1.size()); }
+    void push_back(float a1, float b1, float a2, float b2) {
+        x1.push_back(a1); y1.push_back(b1);
+        x2.push_back(a2); y2.push_back(b2);
+    }
+};
+
+/// Is match i an inlier of F (by rows, F(i,j)=F[3*i+j]), d2 being the square
+/// of the distance threshold?
+inline bool isInlier(const float F[9], const MatchBuffer& m, int i, float d2) {
+    const float lx = F[0]*m.x1[i] + F[3]*m.y1[i] + F[6];
+    const float ly = F[1]*m.x1[i] + F[4]*m.y1[i] + F[7];
+    const float lz = F[2]*m.x1[i] + F[5]*m.y1[i] + F[8];
+    const float r = lx*m.x2[i] + ly*m.y2[i] + lz;
+    return r*r < d2*(lx*lx + ly*ly);
+}
+
+typedef int (*CountKernel)(const float F[9], const MatchBuffer& m,
+                           int begin, int end, float d2);
+
+inline int countScalar(const float F[9], const MatchBuffer& m,
+                       int begin, int end, float d2) {
+    int n=0;
+    for(int i=begin; i<end; i++)
+        n += isInlier(F, m, i, d2);
+    return n;
+}
+
+#ifdef EPIPOLAR_KERNELS_X86
+__attribute__((target("sse2")))
+inline int countSSE(const float F[9], const MatchBuffer& m,
+                    int begin, int end, float d2) {
+    __m128 f[9];
+    for(int k=0; k<9; k++)
+        f[k] = _mm_set1_ps(F[k]);
+    const __m128 vd2 = _mm_set1_ps(d2);
+    __m128i n = _mm_setzero_si128();
+    int i=begin;
+    for(; i+4<=end; i+=4) {
+        const __m128 x1=_mm_loadu_ps(&m.x1[i]), y1=_mm_loadu_ps(&m.y1[i]);
+        const __m128 x2=_mm_loadu_ps(&m.x2[i]), y2=_mm_loadu_ps(&m.y2[i]);
+        const __m128 lx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f[0],x1),
+                                                _mm_mul_ps(f[3],y1)), f[6]);
+        const __m128 ly = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f[1],x1),
+                                                _mm_mul_ps(f[4],y1)), f[7]);
+        const __m128 lz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f[2],x1),
+                                                _mm_mul_ps(f[5],y1)), f[8]);
+        const __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx,x2),
+                                               _mm_mul_ps(ly,y2)), lz);
+        const __m128 l2 = _mm_add_ps(_mm_mul_ps(lx,lx), _mm_mul_ps(ly,ly));
+        // Mask is -1 for inliers
+        n = _mm_sub_epi32(n, _mm_castps_si128(
+                _mm_cmplt_ps(_mm_mul_ps(r,r), _mm_mul_ps(vd2,l2))));
+    }
+    int c[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(c), n);
+    return c[0]+c[1]+c[2]+c[3] + countScalar(F, m, i, end, d2);
+}
+
+__attribute__((target("avx")))
+inline int countAVX(const float F[9], const MatchBuffer& m,
+                    int begin, int end, float d2) {
+    __m256 f[9];
+    for(int k=0; k<9; k++)
+        f[k] = _mm256_set1_ps(F[k]);
+    const __m256 vd2 = _mm256_set1_ps(d2);
+    int n=0;
+    int i=begin;
+    for(; i+8<=end; i+=8) {
+        const __m256 x1=_mm256_loadu_ps(&m.x1[i]), y1=_mm256_loadu_ps(&m.y1[i]);
+        const __m256 x2=_mm256_loadu_ps(&m.x2[i]), y2=_mm256_loadu_ps(&m.y2[i]);
+        const __m256 lx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[0],x1),
+                                                      _mm256_mul_ps(f[3],y1)), f[6]);
+        const __m256 ly = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[1],x1),
+                                                      _mm256_mul_ps(f[4],y1)), f[7]);
+        const __m256 lz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[2],x1),
+                                                      _mm256_mul_ps(f[5],y1)), f[8]);
+        const __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx,x2),
+                                                     _mm256_mul_ps(ly,y2)), lz);
+        const __m256 l2 = _mm256_add_ps(_mm256_mul_ps(lx,lx),
+                                        _mm256_mul_ps(ly,ly));
+        const __m256 in = _mm256_cmp_ps(_mm256_mul_ps(r,r),
+                                        _mm256_mul_ps(vd2,l2), _CMP_LT_OQ);
+        n += __builtin_popcount(_mm256_movemask_ps(in));
+    }
+    return n + countScalar(F, m, i, end, d2);
+}
+#endif
+
+/// Best inlier counting kernel for this CPU
+inline CountKernel countKernel() {
+#ifdef EPIPOLAR_KERNELS_X86
+    if(__builtin_cpu_supports("avx"))
+        return countAVX;
+    if(__builtin_cpu_supports("sse2"))
+        return countSSE;
+#endif
+    return countScalar;
+}
+
+/// Number of inliers of F among matches [begin,end) of m, d2 being the square
+/// of the distance threshold.
+inline int countInliers(const float F[9], const MatchBuffer& m,
+                        int begin, int end, float d2) {
+    static const CountKernel k = countKernel();
+    return k(F, m, begin, end, d2);
+}
+
+} // namespace EpipolarKernels
+
+#endif
@@ -5,13 +5,24 @@
 #include "./Imagine/Features.h"
 #include <Imagine/Graphics.h>
 #include <Imagine/LinAlg.h>
+#include "SiftMatch.h"
+#include "EpipolarKernels.h"
+#include "Bench.h"
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <ctime>
+#include <fstream>
+#include <mutex>
 using namespace Imagine;
 using namespace std;
 
 static const float BETA = 0.01f; // Probability of failure
+static const float DIST_MAX = 1.5f; // Pixel error for inlier/outlier discrimination
+static const int PRE_TEST = 1; // Random matches checked before scoring a model
 
 struct Match {
     float x1, y1, x2, y2;
@@ -19,124 +30,425 @@ struct Match {
 
 // Display SIFT points and fill vector of point correspondences
 void algoSIFT(Image<Color,2> I1, Image<Color,2> I2,
-              vector<Match>& matches) {
+              vector<Match>& matches, const SiftMatch::Options& opt,
+              BenchReport& bench) {
     // Find interest points
+    bench.start("sift");
     SIFTDetector D;
     D.setFirstOctave(-1);
     Array<SIFTDetector::Feature> feats1 = D.run(I1);
+#ifndef HEADLESS
     drawFeatures(feats1, Coords<2>(0,0));
+#endif
     cout << "Im1: " << feats1.size() << flush;
     Array<SIFTDetector::Feature> feats2 = D.run(I2);
+#ifndef HEADLESS
     drawFeatures(feats2, Coords<2>(I1.width(),0));
+#endif
     cout << " Im2: " << feats2.size() << flush;
-
-    const double MAX_DISTANCE = 100.0*100.0;
-    for(size_t i=0; i < feats1.size(); i++) {
-        SIFTDetector::Feature f1=feats1[i];
-        for(size_t j=0; j < feats2.size(); j++) {
-            double d = squaredDist(f1.desc, feats2[j].desc);
-            if(d < MAX_DISTANCE) {
-                Match m;
-                m.x1 = f1.pos.x();
-                m.y1 = f1.pos.y();
-                m.x2 = feats2[j].pos.x();
-                m.y2 = feats2[j].pos.y();
-                matches.push_back(m);
-            }
-        }
+    bench.stop();
+
+    // Nearest neighbors passing the ratio test
+    bench.start("matching", double(feats1.size())*feats2.size());
+    vector<float> d1=SiftMatch::descriptors(feats1),
+                  d2=SiftMatch::descriptors(feats2);
+    vector<SiftMatch::Pair> pairs =
+        SiftMatch::match(d1.data(), int(feats1.size()),
+                         d2.data(), int(feats2.size()), opt);
+    for(size_t k=0; k<pairs.size(); k++) {
+        const SIFTDetector::Feature &f1=feats1[pairs[k].i], &f2=feats2[pairs[k].j];
+        Match m;
+        m.x1 = f1.pos.x();
+        m.y1 = f1.pos.y();
+        m.x2 = f2.pos.x();
+        m.y2 = f2.pos.y();
+        matches.push_back(m);
     }
+    bench.stop();
 }
 
-// RANSAC algorithm to compute F from point matches (8-point algorithm)
-// Parameter matches is filtered to keep only inliers as output.
-
-FMatrix<float,3,3> computeF(vector<Match>& matches) {
-
-    const float distMax = 1.5f; // Pixel error for inlier/outlier discrimination
-    int Niter=100000; // Adjusted dynamically
-    FMatrix<float,3,3> bestF;
-    vector<int> bestInliers;
-
-
-    int n0=0; //the number of points x' which are as close as d from Hx for the best H so far
-    int n; //the number of points x' which are as close as d from Hx for the best H at iteration n
-    for(int iter=0; iter<Niter; iter++){
-    Matrix<float> A(9,9);
-
-    //We define each component of A
-    for(int i=0; i<8; i++){
-    int randIndex=rand()%matches.size();
-    A(i,0)=matches[randIndex].x1*matches[randIndex].x2*0.000001f;A(i,1)=matches[randIndex].x1*matches[randIndex].y2*0.000001f;A(i,2)=matches[randIndex].x1*0.001f;
-    A(i,3)=matches[randIndex].y1*matches[randIndex].x2*0.000001f;A(i,4)=matches[randIndex].y1*matches[randIndex].y2*0.000001f; A(i,5)=matches[randIndex].y1*0.001f;
-    A(i,6)=matches[randIndex].x2*0.001f;A(i,7)=matches[randIndex].y2*0.001f;A(i,8)=1;
+// Work done by a RANSAC run
+struct RansacStats {
+    int iterations; // Samples drawn
+    int models;     // Hypotheses passing the pre-test, scored on all matches
+    long evaluated; // Residuals computed, pre-test included
+};
 
-    };
-    for(int j=0; j<9; j++){ A(8,j)=0;};
+// Coefficients of F by rows, as used by EpipolarKernels
+static void byRows(const FMatrix<float,3,3>& F, float f[9]) {
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+            f[3*i+j] = F(i,j);
+}
 
+// Number of RANSAC iterations so that, with probability 1-BETA, one sample of
+// k matches has only inliers, the proportion of inliers being ratio.
+static int ransacIterations(float ratio, int k, int maxIter) {
+    const double p = pow(double(ratio), k);
+    if(p <= 0)
+        return maxIter;
+    if(p >= 1)
+        return 1;
+    const double n = ceil(log(BETA)/log1p(-p));
+    return (n<maxIter)? int(n): maxIter;
+}
 
+// Minimal solvers, on stack storage so that the RANSAC loop does not allocate.
+// Coordinates are scaled by 0.001 as in the final least squares fit.
 
-    //We do a SVD on A, f is the pseudo eigenvector with single value 0, and A is a function of the two points (x1,y1,1) and (x2,y2,1)
+// Row of the epipolar constraint x1^T F x2 = 0 for match m, F read by rows
+static void epipolarRow(const Match& m, double row[9]) {
+    const double x1=0.001*m.x1, y1=0.001*m.y1, x2=0.001*m.x2, y2=0.001*m.y2;
+    row[0]=x1*x2; row[1]=x1*y2; row[2]=x1;
+    row[3]=y1*x2; row[4]=y1*y2; row[5]=y1;
+    row[6]=x2;    row[7]=y2;    row[8]=1;
+}
 
-            Vector<float> S;
-            Matrix<float> U,Vt,V;
+// Basis of the null space of the k x 9 matrix A (k=7 or 8) by Gaussian
+// elimination with full pivoting. Return false if A is not of rank k.
+static bool nullSpace(double A[][9], int k, double N[2][9]) {
+    int col[9]; // Column permutation
+    for(int j=0; j<9; j++)
+        col[j] = j;
+    double norm=0;
+    for(int i=0; i<k; i++)
+        for(int j=0; j<9; j++)
+            norm = max(norm, abs(A[i][j]));
+    for(int p=0; p<k; p++) {
+        int pi=p, pj=p; // Pivot
+        for(int i=p; i<k; i++)
+            for(int j=p; j<9; j++)
+                if(abs(A[i][col[j]]) > abs(A[pi][col[pj]])) {
+                    pi = i;
+                    pj = j;
+                }
+        if(abs(A[pi][col[pj]]) <= 1e-10*norm)
+            return false;
+        for(int j=0; j<9; j++)
+            swap(A[p][j], A[pi][j]);
+        swap(col[p], col[pj]);
+        for(int i=p+1; i<k; i++) {
+            const double f = A[i][col[p]]/A[p][col[p]];
+            for(int j=p; j<9; j++)
+                A[i][col[j]] -= f*A[p][col[j]];
+        }
+    }
+    // One vector per free column, by back substitution
+    for(int v=0; v<9-k; v++) {
+        double* n = N[v];
+        for(int j=k; j<9; j++)
+            n[col[j]] = (j==k+v)? 1: 0;
+        for(int p=k-1; p>=0; p--) {
+            double s=0;
+            for(int j=p+1; j<9; j++)
+                s += A[p][col[j]]*n[col[j]];
+            n[col[p]] = -s/A[p][col[p]];
+        }
+    }
+    return true;
+}
 
-            svd(A,U,S,Vt);
-            V=transpose(Vt);
-            Matrix<float> N(3,3);
-            N(0,0)=0.001f;N(0,1)=0;N(0,2)=0;N(1,0)=0;N(1,1)=0.001f;N(1,2)=0;N(2,0)=0;N(2,1)=0; N(2,2)=1;
-            Vector<float> FVector = V.getCol(2);
-            Matrix<float> F(3,3);
-            F(0,0)= FVector[0]; F(0,1)= FVector[1]; F(0,2)= FVector[2];
-            F(1,0)= FVector[3]; F(1,1)= FVector[4]; F(1,2)= FVector[5];
-            F(2,0)= FVector[6]; F(2,1)= FVector[7]; F(2,2)= FVector[8];
+// Closest matrix of rank 2 (Frobenius norm): F-(Fv)v^T, v being the
+// eigenvector of F^TF of least eigenvalue, found by Jacobi rotations.
+static void rank2(double F[9]) {
+    double M[3][3], V[3][3]={{1,0,0},{0,1,0},{0,0,1}};
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+            M[i][j] = F[i]*F[j]+F[3+i]*F[3+j]+F[6+i]*F[6+j];
+    for(int sweep=0; sweep<10; sweep++) {
+        const double off = M[0][1]*M[0][1]+M[0][2]*M[0][2]+M[1][2]*M[1][2];
+        const double diag = M[0][0]*M[0][0]+M[1][1]*M[1][1]+M[2][2]*M[2][2];
+        if(off <= 1e-30*diag)
+            break;
+        for(int p=0; p<2; p++)
+            for(int q=p+1; q<3; q++) {
+                if(M[p][q] == 0)
+                    continue;
+                const double theta = (M[q][q]-M[p][p])/(2*M[p][q]);
+                const double t = (theta>=0? 1: -1)/(abs(theta)+sqrt(theta*theta+1));
+                const double c=1/sqrt(t*t+1), s=t*c;
+                for(int k=0; k<3; k++) { // M <- M J
+                    const double a=M[k][p], b=M[k][q];
+                    M[k][p]=c*a-s*b; M[k][q]=s*a+c*b;
+                }
+                for(int k=0; k<3; k++) { // M <- J^T M
+                    const double a=M[p][k], b=M[q][k];
+                    M[p][k]=c*a-s*b; M[q][k]=s*a+c*b;
+                }
+                for(int k=0; k<3; k++) {
+                    const double a=V[k][p], b=V[k][q];
+                    V[k][p]=c*a-s*b; V[k][q]=s*a+c*b;
+                }
+            }
+    }
+    int m=0;
+    for(int i=1; i<3; i++)
+        if(M[i][i] < M[m][m])
+            m = i;
+    const double v[3] = {V[0][m], V[1][m], V[2][m]};
+    for(int i=0; i<3; i++) {
+        const double fv = F[3*i]*v[0]+F[3*i+1]*v[1]+F[3*i+2]*v[2];
+        for(int j=0; j<3; j++)
+            F[3*i+j] -= fv*v[j];
+    }
+}
 
-    F=N*F*N;
-    n=0;
+// F in pixel coordinates from F in scaled coordinates, read by rows
+static FMatrix<float,3,3> pixelF(const double f[9]) {
+    const double s[3] = {0.001, 0.001, 1};
+    FMatrix<float,3,3> F;
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+            F(i,j) = float(s[i]*f[3*i+j]*s[j]);
+    return F;
+}
 
-    Vector<float> D;
-    Matrix<float> X,Yt,Y;
-    svd(F,X,D,Yt);
+// Real roots of a3 x^3+a2 x^2+a1 x+a0, returned in r. Return their number.
+static int cubicRoots(double a3, double a2, double a1, double a0, double r[3]) {
+    const double scale = max(max(abs(a3),abs(a2)), max(abs(a1),abs(a0)));
+    if(abs(a3) <= 1e-12*scale) { // Quadratic (or less)
+        if(abs(a2) <= 1e-12*scale) {
+            if(a1 == 0)
+                return 0;
+            r[0] = -a0/a1;
+            return 1;
+        }
+        const double delta = a1*a1-4*a2*a0;
+        if(delta < 0)
+            return 0;
+        const double q = -0.5*(a1+(a1>=0? 1: -1)*sqrt(delta));
+        r[0] = q/a2;
+        if(q == 0)
+            return 1;
+        r[1] = a0/q;
+        return 2;
+    }
+    // Depressed cubic t^3+pt+q with x=t-b/3
+    const double b=a2/a3, c=a1/a3, d=a0/a3;
+    const double p = c-b*b/3, q = 2*b*b*b/27-b*c/3+d;
+    const double delta = q*q/4+p*p*p/27;
+    if(delta > 0) { // One real root
+        const double u = cbrt(-q/2+sqrt(delta)), v = cbrt(-q/2-sqrt(delta));
+        r[0] = u+v-b/3;
+        return 1;
+    }
+    if(p == 0) {
+        r[0] = -b/3;
+        return 1;
+    }
+    const double pi = 3.14159265358979323846;
+    const double m = 2*sqrt(-p/3);
+    const double phi = acos(max(-1.0, min(1.0, 3*q/(p*m))))/3;
+    for(int k=0; k<3; k++)
+        r[k] = m*cos(phi-2*pi*k/3)-b/3;
+    return 3;
+}
 
-    D[2] = 0;
+// Determinant of the 3x3 matrix F read by rows
+static double det3(const double F[9]) {
+    return F[0]*(F[4]*F[8]-F[5]*F[7]) - F[1]*(F[3]*F[8]-F[5]*F[6])
+         + F[2]*(F[3]*F[7]-F[4]*F[6]);
+}
 
-    Matrix<float> Delta(3,3);
-    Delta(0,0)=D[0],Delta(0,1)=0;Delta(0,2)=0;
-    Delta(1,0)=0;Delta(1,1)=D[1],Delta(1,2)=0;
-    Delta(2,0)=0;Delta(2,1)=0;Delta(2,2)=0;
+// 8-point algorithm on sample, model of rank 2. Return number of models (0/1).
+static int solve8(const Match* const sample[8], FMatrix<float,3,3> F[3]) {
+    double A[8][9], N[2][9];
+    for(int i=0; i<8; i++)
+        epipolarRow(*sample[i], A[i]);
+    if(! nullSpace(A, 8, N))
+        return 0;
+    rank2(N[0]);
+    F[0] = pixelF(N[0]);
+    return 1;
+}
 
-    F=X*Delta*Yt;
+// 7-point algorithm: F=aF1+(1-a)F2 in the null space of the sample, with
+// det(F)=0, a cubic in a. Return number of models (0 to 3).
+static int solve7(const Match* const sample[7], FMatrix<float,3,3> F[3]) {
+    double A[7][9], N[2][9];
+    for(int i=0; i<7; i++)
+        epipolarRow(*sample[i], A[i]);
+    if(! nullSpace(A, 7, N))
+        return 0;
+    // Cubic coefficients from its values at a=0,1,-1,2
+    double d[4];
+    const double at[4] = {0, 1, -1, 2};
+    for(int k=0; k<4; k++) {
+        double G[9];
+        for(int j=0; j<9; j++)
+            G[j] = at[k]*N[0][j]+(1-at[k])*N[1][j];
+        d[k] = det3(G);
+    }
+    const double a0=d[0], a2=(d[1]+d[2])/2-a0, s=(d[1]-d[2])/2;
+    const double a3=(d[3]-4*a2-a0-2*s)/6, a1=s-a3;
+    double roots[3];
+    const int n = cubicRoots(a3, a2, a1, a0, roots);
+    for(int k=0; k<n; k++) {
+        double G[9];
+        for(int j=0; j<9; j++)
+            G[j] = roots[k]*N[0][j]+(1-roots[k])*N[1][j];
+        F[k] = pixelF(G);
+    }
+    return n;
+}
 
-    // We count how many inliers there are
-    for (size_t MatchIndex=0; MatchIndex<matches.size(); MatchIndex++){
-    float x;
-    float y;
-    float z;
-    x = matches[MatchIndex].x1*F(0,0)+matches[MatchIndex].y1*F(1,0)+F(2,0);
-    y = matches[MatchIndex].x1*F(0,1)+matches[MatchIndex].y1*F(1,1)+F(2,1);
-    z = matches[MatchIndex].x1*F(0,2)+matches[MatchIndex].y1*F(1,2)+F(2,2);
+// Best model of a batch of RANSAC iterations
+struct RansacBatch {
+    FMatrix<float,3,3> F;
+    int inliers; // Number of inliers of F, 0 if no model beat the bound
+    RansacStats stats;
+};
 
-    if(abs(x*matches[MatchIndex].x2+y*matches[MatchIndex].y2+z)/sqrt(pow(x,2)+pow(y,2)) < distMax ){ n = n+1;}
+// Run RANSAC iterations with samples of stream `stream` of seed. Models must
+// have more than bound inliers and, if shared is not null, more than the best
+// count of all threads that it holds; it is raised when a better model is
+// found. Hypotheses must first pass the T(1,1) test (Matas and Chum, 2004): a
+// random match must be an inlier, otherwise the model is discarded. Scoring
+// stops once the model cannot beat the best one.
+static RansacBatch ransacBatch(const vector<Match>& matches,
+                               const EpipolarKernels::MatchBuffer& buffer,
+                               int sampleSize, int iterations,
+                               uint64_t seed, int stream, int bound,
+                               atomic<int>* shared) {
+    using EpipolarKernels::countInliers;
+    using EpipolarKernels::isInlier;
+    const float d2 = DIST_MAX*DIST_MAX;
+    const int chunk=64; // Matches scored between checks of the best count
+    const int nMatches = (int)matches.size();
+    Parallel::CounterRNG rng(seed, stream);
+    RansacBatch r;
+    r.inliers = 0;
+    r.stats.iterations = iterations;
+    r.stats.models = 0;
+    r.stats.evaluated = 0;
+    int n0=bound; // Count to beat
+    for(int iter=0; iter<iterations; iter++) {
+        // Sample of distinct matches
+        int index[8];
+        const Match* sample[8];
+        for(int i=0; i<sampleSize; i++) {
+            do
+                index[i] = rng(nMatches);
+            while(find(index, index+i, index[i]) != index+i);
+            sample[i] = &matches[index[i]];
+        }
+        FMatrix<float,3,3> F[3];
+        const int nModels = (sampleSize==7)? solve7(sample, F): solve8(sample, F);
+
+        for(int k=0; k<nModels; k++) {
+            float f[9];
+            byRows(F[k], f);
+            // Pre-test on random matches
+            bool passed=true;
+            for(int t=0; t<PRE_TEST && passed; t++, r.stats.evaluated++)
+                passed = isInlier(f, buffer, rng(nMatches), d2);
+            if(! passed)
+                continue;
+            r.stats.models++;
+
+            // Count inliers, until the best cannot be reached
+            const int best = shared? max(n0, shared->load()): n0;
+            int n=0;
+            for(int i=0; i<nMatches && n+nMatches-i>best; i+=chunk) {
+                const int end = min(nMatches, i+chunk);
+                n += countInliers(f, buffer, i, end, d2);
+                r.stats.evaluated += end-i;
+            }
+            if(n > best) {
+                n0 = r.inliers = n;
+                r.F = F[k];
+                int old = shared? shared->load(): 0;
+                while(shared && old<n && !shared->compare_exchange_weak(old,n))
+                    ;
+            }
+        }
+    }
+    return r;
 }
 
-    // We store the best F we had so far
-    if(n>n0){n0=n;
-        bestF(0,0)=F(0,0);bestF(0,1)=F(0,1);bestF(0,2)=F(0,2);
-        bestF(1,0)=F(1,0);bestF(1,1)=F(1,1);bestF(1,2)=F(1,2);
-        bestF(2,0)=F(2,0);bestF(2,1)=F(2,1);bestF(2,2)=F(2,2);}
-}
-    // Setting the best in-liers
+// RANSAC algorithm to compute F from point matches, with minimal samples of
+// sampleSize matches (7 or 8-point algorithm).
+// Parameter matches is filtered to keep only inliers as output.
+// Iterations are run by batches on the threads of the pool, each batch with
+// its own random stream. Their number adapts to the best inlier ratio found.
+// If deterministic, batches run by rounds whose results are merged in order,
+// so that the result depends only on seed.
+
+FMatrix<float,3,3> computeF(vector<Match>& matches, int sampleSize,
+                            uint64_t seed, bool deterministic,
+                            RansacStats& stats) {
+
+    const int maxIter=100000;
+    const int batch=32; // Iterations per random stream
+    int Niter=maxIter; // Adjusted dynamically
+    FMatrix<float,3,3> bestF(0.0f);
+    vector<int> bestInliers;
+    stats.iterations = stats.models = 0;
+    stats.evaluated = 0;
+    if(matches.size() < 8) { // Not enough matches for a model
+        matches.clear();
+        return bestF;
+    }
 
-    for (size_t MatchIndex=0; MatchIndex< matches.size(); MatchIndex++){
+    using EpipolarKernels::isInlier;
+    const float d2 = DIST_MAX*DIST_MAX;
+    EpipolarKernels::MatchBuffer buffer;
+    for(size_t i=0; i<matches.size(); i++)
+        buffer.push_back(matches[i].x1, matches[i].y1,
+                         matches[i].x2, matches[i].y2);
 
-    float x;
-    float y;
-    float z;
-    x = matches[MatchIndex].x1*bestF(0,0)+matches[MatchIndex].y1*bestF(1,0)+bestF(2,0);
-    y = matches[MatchIndex].x1*bestF(0,1)+matches[MatchIndex].y1*bestF(1,1)+bestF(2,1);
-    z = matches[MatchIndex].x1*bestF(0,2)+matches[MatchIndex].y1*bestF(1,2)+bestF(2,2);
+    const int nMatches = (int)matches.size();
+    int n0=0; //the number of points x' which are as close as d from Hx for the best H so far
+    // Keep the best model of a batch
+    auto merge = [&](const RansacBatch& r) {
+        stats.iterations += r.stats.iterations;
+        stats.models += r.stats.models;
+        stats.evaluated += r.stats.evaluated;
+        if(r.inliers > n0) {
+            n0 = r.inliers;
+            bestF = r.F;
+            // A good model passes the pre-test with probability n0/nMatches
+            Niter = ransacIterations(n0/float(nMatches), sampleSize+PRE_TEST,
+                                     maxIter);
+        }
+    };
+    if(deterministic) {
+        const int round=16; // Batches per round
+        for(int b0=0; b0*batch<Niter; b0+=round) {
+            vector<RansacBatch> r(round);
+            const int bound=n0;
+            Parallel::parallelFor(round, [&](int i) {
+                r[i] = ransacBatch(matches, buffer, sampleSize, batch, seed,
+                                   b0+i, bound, 0);
+            });
+            for(int i=0; i<round; i++)
+                merge(r[i]);
+        }
+    } else {
+        // Each thread takes batches until enough iterations have started
+        atomic<int> next(0), shared(0), limit(Niter);
+        mutex m;
+        Parallel::parallelFor(Parallel::pool().size(), [&](int) {
+            for(int b=next++; b*batch<limit; b=next++) {
+                RansacBatch r = ransacBatch(matches, buffer, sampleSize, batch,
+                                            seed, b, 0, &shared);
+                lock_guard<mutex> lock(m);
+                merge(r);
+                limit = Niter;
+            }
+        });
+    }
+    // Setting the best in-liers
 
-    if(abs(x*matches[MatchIndex].x2+y*matches[MatchIndex].y2+z)/sqrt(pow(x,2)+pow(y,2)) < distMax ){bestInliers.push_back(MatchIndex);};
+    float f[9];
+    byRows(bestF, f);
+    for (int MatchIndex=0; MatchIndex<nMatches; MatchIndex++){
+    if(isInlier(f, buffer, MatchIndex, d2)){bestInliers.push_back(MatchIndex);};
 }
+    if(bestInliers.size() < 8) { // No model supported by enough matches
+        matches.clear();
+        return bestF;
+    }
   // now we re-evaluate the model over all the in-liers
 
     Matrix<float> A(bestInliers.size(),9);
@@ -153,13 +465,11 @@ FMatrix<float,3,3> computeF(vector<Match>& matches) {
     //computes F
     Vector<float> S1;
     Matrix<float> U1,V1t,V1;
-    cout << "we are going to compute F with minimal distance"<<endl;
-    cout << "A="<< A << endl;
     svd(A,U1,S1,V1t);
     V1=transpose(V1t);
     Matrix<float> N(3,3);
     N(0,0)=0.001f;N(0,1)=0;N(0,2)=0;N(1,0)=0;N(1,1)=0.001f;N(1,2)=0;N(2,0)=0;N(2,1)=0; N(2,2)=1;
-    Vector<float> FVector = V1.getCol(2);
+    Vector<float> FVector = V1.getCol(8);
 
     // We set the smaller single value of F to 0
     Matrix<float> F(3,3);
@@ -168,7 +478,6 @@ FMatrix<float,3,3> computeF(vector<Match>& matches) {
     F(2,0)= FVector[6]; F(2,1)= FVector[7]; F(2,2)= FVector[8];
 
     F=N*F*N;
-    n=0;
 
     Vector<float> D1;
     Matrix<float> X1,Y1t,Y1;
@@ -202,9 +511,10 @@ FMatrix<float,3,3> computeF(vector<Match>& matches) {
     return bestF;
 }
 
+#ifndef HEADLESS
 // Expects clicks in one image and show corresponding line in other image.
 // Stop at right-click.
-void displayEpipolar(Image<Color> I1, Image<Color> I2,
+void displayEpipolar(Image<Color> I1, Image<Color> /*I2*/,
                      const FMatrix<float,3,3>& F) {
 
     while(true) {
@@ -235,13 +545,61 @@ void displayEpipolar(Image<Color> I1, Image<Color> I2,
         // --------------- TODO ------------
     }
 }
+#endif
+
+// Write F and inlier matches (x1 y1 x2 y2 per line) to text file
+bool saveResult(const string& fileName, const FMatrix<float,3,3>& F,
+                const vector<Match>& matches) {
+    ofstream f(fileName.c_str());
+    for(int i=0; i<3; i++)
+        f << F(i,0) << ' ' << F(i,1) << ' ' << F(i,2) << endl;
+    for(size_t i=0; i<matches.size(); i++)
+        f << matches[i].x1 << ' ' << matches[i].y1 << ' '
+          << matches[i].x2 << ' ' << matches[i].y2 << endl;
+    return bool(f);
+}
 
 int main(int argc, char* argv[])
 {
     srand((unsigned int)time(0));
 
-    const char* s1 = argc>1? argv[1]: srcPath("im1.jpg");
-    const char* s2 = argc>2? argv[2]: srcPath("im2.jpg");
+    // Options (--name=value) come before positional arguments
+    string outFile;  // F and inliers
+    string jsonFile; // Stage timings
+    SiftMatch::Options match;
+    int nThreads=0;  // Threads for matching and RANSAC (0: hardware threads)
+    int sampleSize=8; // Matches per RANSAC sample (7 or 8-point algorithm)
+    uint64_t seed=(uint64_t)time(0); // Of RANSAC random streams
+    bool deterministic=false; // Same result for same seed
+    int a=1;
+    for(; a<argc && string(argv[a]).compare(0,2,"--")==0; a++) {
+        string opt(argv[a]);
+        if(opt.compare(0,6,"--out=")==0)
+            outFile = opt.substr(6);
+        else if(opt.compare(0,7,"--json=")==0)
+            jsonFile = opt.substr(7);
+        else if(opt.compare(0,8,"--ratio=")==0)
+            match.ratio = stof(opt.substr(8));
+        else if(opt == "--mutual")
+            match.mutual = true;
+        else if(opt.compare(0,9,"--checks=")==0)
+            match.checks = stoi(opt.substr(9));
+        else if(opt.compare(0,10,"--threads=")==0)
+            nThreads = stoi(opt.substr(10));
+        else if(opt == "--sample=7" || opt == "--sample=8")
+            sampleSize = stoi(opt.substr(9));
+        else if(opt.compare(0,7,"--seed=")==0) {
+            seed = stoull(opt.substr(7));
+            deterministic = true;
+        }
+        else {
+            cerr << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Parallel::pool(nThreads);
+    const char* s1 = argc>a? argv[a]: srcPath("im1.jpg");
+    const char* s2 = argc>a+1? argv[a+1]: srcPath("im2.jpg");
 
     // Load and display images
     Image<Color,2> I1, I2;
@@ -250,21 +608,39 @@ int main(int argc, char* argv[])
         cerr<< "Unable to load images" << endl;
         return 1;
     }
+#ifndef HEADLESS
     int w = I1.width();
     openWindow(2*w, I1.height());
     display(I1,0,0);
     display(I2,w,0);
+#endif
 
+    BenchReport bench("Fundamental");
     vector<Match> matches;
-    algoSIFT(I1, I2, matches);
+    algoSIFT(I1, I2, matches, match, bench);
     const int n = (int)matches.size();
     cout << " matches: " << n << endl;
+#ifndef HEADLESS
     drawString(100,20,std::to_string(n)+ " matches",RED);
     click();
-    
-    FMatrix<float,3,3> F = computeF(matches);
+#endif
+
+    bench.start("ransac");
+    RansacStats stats;
+    FMatrix<float,3,3> F = computeF(matches, sampleSize, seed, deterministic,
+                                    stats);
+    bench.setWork(double(stats.evaluated));
+    bench.stop();
+    cout << "RANSAC: " << stats.iterations << " iterations, " << stats.models
+         << " models scored, " << stats.evaluated << " residuals" << endl;
     cout << "F="<< endl << F;
 
+    if(! outFile.empty() && ! saveResult(outFile, F, matches))
+        cerr << "Error writing " << outFile << endl;
+    if(! jsonFile.empty() && ! bench.write(jsonFile))
+        cerr << "Error writing " << jsonFile << endl;
+
+#ifndef HEADLESS
     // Redisplay with matches
     display(I1,0,0);
     display(I2,w,0);
@@ -282,5 +658,8 @@ int main(int argc, char* argv[])
     displayEpipolar(I1, I2, F);
 
     endGraphics();
+#else
+    cout << matches.size() << "/" << n << " inliers" << endl;
+#endif
     return 0;
 }
@@ -6,9 +6,18 @@
 #include <Imagine/Images.h>
 #include <iostream>
 #include <algorithm>
+#include <climits>
 #include <string>
 #include "maxflow/graph.h"
+#include "GridGraph.h"
+#include "Parallel.h"
+#include "Bench.h"
+#include "PlyWriter.h"
+#include "QuadMesh.h"
 #include <Imagine/LinAlg.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace Imagine;
 using namespace std;
@@ -26,8 +35,8 @@ static int dmin=-37, dmax=-7; // Min and max disparities 10 and 55 for face0 and
 // only look at pixels (win+zoom*i,win+zoom*j) with win the radius of patch.
 const int win = (7-1)/2;    // Correlation patches of size (2n+1)*(2n+1)
 const float lambdaf = 0.5;  // Weight of regularization (smoothing) term
-const int zoom = 2;         // Zoom factor (to speedup computations)
-const float sigma = 6/zoom; // Gaussian blur parameter for disparity
+static int zoom = 2;        // Zoom factor (to speedup computations)
+static float sigma = 6/zoom;// Gaussian blur parameter for disparity
 // Energy discretization precision (as we build a graph with 'int' weights)
 const int wcc = std::max(1+int(1/lambdaf),30);
 const int lambda = lambdaf*wcc; // Regularization term (must be >= 1)
@@ -73,106 +82,257 @@ void control3D(const Mesh& Mt, const Mesh& Mg) {
 }
 #endif
 
-void show3D(const byteImage& I, const doubleImage& D, int zoom) {
-#ifdef IMAGINE_OPENGL
-    cout << "Click to compute depth map and 3D mesh renderings... " << flush;
-    click();
-
-    // Compute 3D point cloud: magic constants depending on camera pose
-    const float f  = 750;  // Focal
-    const float d0 = 100;  // Disparity for infinite depth (due to crop)
-    const float B  = -0.20;// Baseline
-
-    const int nx=D.width(), ny=D.height();
-    FMatrix<float,3,3> K(0.0f);
+// Back-projection of the zoomed disparity grid to 3D: magic constants
+// depending on camera pose
+struct Camera {
+    Camera(int nx, int ny, int zoom);
+    /// 3D point of grid pixel (i,j) of disparity d
+    FloatPoint3 point(int i, int j, double d) const {
+        float z = f*B/(d0+d);
+        FloatPoint3 pt((float)i,(float)j,1.0f);
+        return K*pt*z;
+    }
+    static const float f, d0, B;
+    FMatrix<float,3,3> K; // Inverse of intrinsic parameters
+};
+const float Camera::f  = 750;  // Focal
+const float Camera::d0 = 100;  // Disparity for infinite depth (due to crop)
+const float Camera::B  = -0.20;// Baseline
+
+Camera::Camera(int nx, int ny, int zoom): K(0.0f) {
     K(0,0)= -f/zoom; K(0,2)=nx/2;
     K(1,1)=  f/zoom; K(1,2)=ny/2;
     K(2,2)=1.0f;
     K = inverse(K);
     K /= K(2,2);
-    Array<FloatPoint3> p(nx*ny);
-    Array<Color> pcol(nx*ny);
-    for(int j=0; j<ny; j++)
-        for(int i=0; i<nx; i++) {
-            float z = f*B/(d0+D(i,j));
-            FloatPoint3 pt((float)i,(float)j,1.0f);
-            p[i+nx*j] = K*pt*z;
-            pcol[i+nx*j] = Color(I(i*zoom,j*zoom));
-        }
-    // Create mesh from 3D point cloud
-    Array<Triangle> t(2*(nx-1)*(ny-1));
-    Array<Color> tcol(2*(nx-1)*(ny-1));
-    for(int j=0; j+1<ny; j++)
-        for(int i=0; i+1<nx; i++) {
-            // Create triangles with next pixels in line/column
-            t[2*(i+j*(nx-1))]   = Triangle(i+nx*j,   i+1+nx*j,     i+nx*(j+1));
-            t[2*(i+j*(nx-1))+1] = Triangle(i+1+nx*j, i+1+nx*(j+1), i+nx*(j+1));
-            tcol[2*(i+j*(nx-1))]   = pcol[i+nx*j];
-            tcol[2*(i+j*(nx-1))+1] = pcol[i+nx*j];
+}
+
+// Write the regular 3D mesh of disparity map D, colored by I, to binary PLY
+// file: two triangles per grid cell, each block of rows back-projected and
+// written in parallel. Return false on error.
+bool writePLY(const string& fileName, const byteImage& I, const doubleImage& D,
+              int zoom) {
+    const int nx=D.width(), ny=D.height();
+    if(nx<2 || ny<2)
+        return false;
+    const Camera cam(nx, ny, zoom);
+    PlyWriter ply(fileName, int64_t(nx)*ny, 2*int64_t(nx-1)*(ny-1));
+    if(! ply.ok())
+        return false;
+    const int rows = 16; // Rows per block
+    Parallel::parallelFor((ny+rows-1)/rows, [&](int b) {
+        const int j0=b*rows, j1=min(ny,j0+rows), jf=min(ny-1,j1);
+        vector<char> buf(size_t(nx)*rows*2*PlyWriter::FACE_BYTES);
+        char* p = &buf[0];
+        for(int j=j0; j<j1; j++)
+            for(int i=0; i<nx; i++) {
+                const FloatPoint3 q = cam.point(i, j, D(i,j));
+                p = PlyWriter::vertex(p, q.x(), q.y(), q.z(),
+                                      Color(I(i*zoom,j*zoom)));
+            }
+        ply.writeVertices(int64_t(nx)*j0, &buf[0], int64_t(nx)*(j1-j0));
+        p = &buf[0];
+        for(int j=j0; j<jf; j++)
+            for(int i=0; i+1<nx; i++) {
+                p = PlyWriter::face(p, i+nx*j,   i+1+nx*j,     i+nx*(j+1));
+                p = PlyWriter::face(p, i+1+nx*j, i+1+nx*(j+1), i+nx*(j+1));
+            }
+        if(jf > j0)
+            ply.writeFaces(2*int64_t(nx-1)*j0, &buf[0], 2*int64_t(nx-1)*(jf-j0));
+    });
+    return ply.close();
+}
+
+// Write adaptive mesh m of disparity map D, colored by I, to binary PLY file,
+// by blocks of vertices and faces in parallel. Return false on error.
+bool writePLY(const string& fileName, const byteImage& I, const doubleImage& D,
+              int zoom, const QuadMesh::Mesh& m) {
+    const int nx=D.width();
+    const int64_t nv=m.vertex.size(), nf=m.face.size()/3;
+    const Camera cam(nx, D.height(), zoom);
+    PlyWriter ply(fileName, nv, nf);
+    if(! ply.ok())
+        return false;
+    const int block = 4096; // Records per block
+    const int nbv=int((nv+block-1)/block), nbf=int((nf+block-1)/block);
+    Parallel::parallelFor(nbv+nbf, [&](int b) {
+        char buf[block*PlyWriter::VERTEX_BYTES];
+        char* p = buf;
+        if(b < nbv) {
+            const int64_t k0=int64_t(b)*block, k1=min(nv,k0+block);
+            for(int64_t k=k0; k<k1; k++) {
+                const int i=m.vertex[k]%nx, j=m.vertex[k]/nx;
+                const FloatPoint3 q = cam.point(i, j, D(i,j));
+                p = PlyWriter::vertex(p, q.x(), q.y(), q.z(),
+                                      Color(I(i*zoom,j*zoom)));
+            }
+            ply.writeVertices(k0, buf, k1-k0);
+        } else {
+            const int64_t k0=int64_t(b-nbv)*block, k1=min(nf,k0+block);
+            for(int64_t k=k0; k<k1; k++)
+                p = PlyWriter::face(p, m.face[3*k], m.face[3*k+1], m.face[3*k+2]);
+            ply.writeFaces(k0, buf, k1-k0);
         }
+    });
+    return ply.close();
+}
+
+#ifndef HEADLESS
+// Show mesh m of disparity map D (see QuadMesh.h), colored by I
+#ifdef IMAGINE_OPENGL
+void show3D(const byteImage& I, const doubleImage& D, int zoom,
+            const QuadMesh::Mesh& m) {
+    cout << "Click to compute depth map and 3D mesh renderings... " << flush;
+    click();
+
+    // Compute 3D point cloud
+    const int nx=D.width(), ny=D.height();
+    const int nv=int(m.vertex.size()), nf=int(m.face.size()/3);
+    const Camera cam(nx, ny, zoom);
+    Array<FloatPoint3> p(nv);
+    Array<Color> pcol(nv);
+    for(int k=0; k<nv; k++) {
+        const int i=m.vertex[k]%nx, j=m.vertex[k]/nx;
+        p[k] = cam.point(i, j, D(i,j));
+        pcol[k] = Color(I(i*zoom,j*zoom));
+    }
+    // Triangles, colored as their first vertex
+    Array<Triangle> t(nf);
+    Array<Color> tcol(nf);
+    for(int k=0; k<nf; k++) {
+        t[k] = Triangle(m.face[3*k], m.face[3*k+1], m.face[3*k+2]);
+        tcol[k] = pcol[m.face[3*k]];
+    }
     // Mesh with texture from original image
-    Mesh Mt(p.data(), nx*ny, t.data(), 2*(nx-1)*(ny-1), 0, 0, FACE_COLOR);
+    Mesh Mt(p.data(), nv, t.data(), nf, 0, 0, FACE_COLOR);
     Mt.setColors(TRIANGLE, tcol.data());
     // Mesh with artificial light
-    Mesh Mg(p.data(), nx*ny, t.data(), 2*(nx-1)*(ny-1), 0, 0,
+    Mesh Mg(p.data(), nv, t.data(), nf, 0, 0,
             CONSTANT_COLOR, SMOOTH_SHADING);
     cout << "done" << endl;
 
     doc();
     control3D(Mt, Mg);
+}
 #else
+void show3D(const byteImage&, const doubleImage&, int, const QuadMesh::Mesh&) {
     cout << "No 3D: Imagine++ not built with OpenGL support" << endl;
-#endif
 }
+#endif
+#endif
 
-// Return image of mean intensity value over (2win+1)x(2win+1) patch
-doubleImage meanImage(const byteImage& I) {
-    int w = I.width(), h = I.height();
-    doubleImage IM(w,h);
-    double area = (2*win+1)*(2*win+1);
-    for(int j=0; j<h; j++)
-        for(int i=0; i<w; i++) {
-            if (j-win<0 || j+win>=h || i-win<0 ||i+win>=w) {
-                IM(i,j)=0;
-                continue;
+/// Sums of pixel values and of their squares over the patches of an image at
+/// the rows of the zoomed grid, for all columns. Rows of zoomed grid y cover
+/// image rows zoom*y...zoom*y+2win, entry u+w*y is for left column u.
+struct PatchStats {
+    PatchStats(const byteImage& I, int ny);
+    int w; ///< Number of patch columns
+    vector<int> s, ss;
+};
+
+/// Separable box filter: column sums slide down zoom rows at a time, sums
+/// over patches slide along rows.
+PatchStats::PatchStats(const byteImage& I, int ny)
+: w(I.width()-2*win), s(max(0,w)*ny), ss(max(0,w)*ny) {
+    const int n=2*win+1;
+    vector<int> cs(I.width(),0), css(I.width(),0); // Column sums
+    for(int y=0; y<ny; y++) {
+        // Rows entering and leaving the patch
+        int r0=zoom*y, r1=zoom*y+n;
+        if(y>0 && zoom<n) {
+            for(int r=zoom*(y-1); r<r0; r++)
+                for(int u=0; u<I.width(); u++) {
+                    const int v=I(u,r);
+                    cs[u] -= v; css[u] -= v*v;
+                }
+            r0 = zoom*(y-1)+n;
+        } else
+            fill(cs.begin(),cs.end(),0), fill(css.begin(),css.end(),0);
+        for(int r=r0; r<r1; r++)
+            for(int u=0; u<I.width(); u++) {
+                const int v=I(u,r);
+                cs[u] += v; css[u] += v*v;
             }
-            double sum = 0;
-            for(int y=-win; y<=win; y++)
-                for(int x=-win; x<=win; x++)
-                    sum += I(x+i,y+j);
-            IM(i,j) = sum / area;
+        int a=0, b=0;
+        for(int u=0; u<n-1 && u<I.width(); u++)
+            a += cs[u], b += css[u];
+        for(int u=0; u<w; u++) {
+            a += cs[u+n-1]; b += css[u+n-1];
+            s[u+w*y] = a; ss[u+w*y] = b;
+            a -= cs[u]; b -= css[u];
         }
-    return IM;
+    }
 }
 
-// Compute correlation between two pixels in images 1 and 2
-double correl(const byteImage& I1,    // Image 1
-              const doubleImage& I1M, // Image of mean value over patch
-              const byteImage& I2,    // Image2
-              const doubleImage& I2M, // Image of mean value over patch
-              int u1, int v1,         // Pixel of interest in image 1
-              int u2, int v2) {       // Pixel of interest in image 2
-    double c=0;
-    for(int y=-win; y<=win; y++)
-        for(int x=-win; x<=win; x++) 
-            c += (I1(u1+x,v1+y)-I1M(u1,v1)) * (I2(u2+x,v2+y)-I2M(u2,v2));
-    return c / ((2*win+1)*(2*win+1));
+/// Dissimilarity sqrt(1-ZNCC) between patches of the zoomed grid in I1 and
+/// their translation by d in I2, for rows [y0,y1) of the grid: R[x+nx*y].
+/// Cross sums are incremental as in PatchStats. ZNCC is taken as 1 near the
+/// borders, and as 0 for uniform patches.
+void cost_slice(const byteImage& I1, const byteImage& I2,
+                const PatchStats& P1, const PatchStats& P2,
+                int nx, int d, int y0, int y1, float* R) {
+    const int n=2*win+1, area=n*n, w1=I1.width(), w2=I2.width();
+    // Valid x: patch inside images and student's border condition
+    int xa=nx, xb=0;
+    for(int x=0; x<nx; x++)
+        if(x*zoom>0 && x*zoom<w1-win && x*zoom+d+dmin>0 && x*zoom+d+dmin<w2-win
+           && zoom*x+n<=w1 && zoom*x+d>=0 && zoom*x+d+n<=w2) {
+            xa = min(xa,x);
+            xb = x+1;
+        }
+    // Columns u of I1 (u+d of I2) in patches of valid x
+    const int ua=zoom*xa, ub=zoom*(xb-1)+n;
+    vector<int> cp(max(0,ub-ua),0); // Column sums of products, from ua
+    for(int y=y0; y<y1; y++) {
+        float* r = R+nx*y;
+        for(int x=0; x<nx; x++)
+            r[x] = 0;
+        if(xa >= xb)
+            continue;
+        int r0=zoom*y, r1=zoom*y+n;
+        if(y>y0 && zoom<n) {
+            for(int v=zoom*(y-1); v<r0; v++) {
+                const byte *p1=&I1(ua,v), *p2=&I2(ua+d,v);
+                for(int u=0; u<ub-ua; u++)
+                    cp[u] -= int(p1[u])*p2[u];
+            }
+            r0 = zoom*(y-1)+n;
+        } else
+            fill(cp.begin(), cp.end(), 0);
+        for(int v=r0; v<r1; v++) {
+            const byte *p1=&I1(ua,v), *p2=&I2(ua+d,v);
+            for(int u=0; u<ub-ua; u++)
+                cp[u] += int(p1[u])*p2[u];
+        }
+        int s12=0;
+        for(int u=0; u<n; u++)
+            s12 += cp[u];
+        for(int x=xa; x<xb; x++) {
+            if(x > xa) // Slide window by zoom columns
+                for(int u=zoom*(x-1); u<zoom*x; u++)
+                    s12 += cp[u+n-ua] - cp[u-ua];
+            const int i1=zoom*x+P1.w*y, i2=zoom*x+d+P2.w*y;
+            const long long s1=P1.s[i1], s2=P2.s[i2];
+            const long long v1 = area*(long long)P1.ss[i1] - s1*s1;
+            const long long v2 = area*(long long)P2.ss[i2] - s2*s2;
+            float term=0;
+            if(v1!=0 && v2!=0)
+                term = float((area*(long long)s12 - s1*s2)/sqrt(double(v1)*v2));
+            r[x] = (term<0)? 1: sqrt(1-term);
+        }
+    }
 }
 
-// Compute ZNCC between two patches in images 1 and 2
-double zncc(const byteImage& I1,    // Image 1
-            const doubleImage& I1M, // Image of mean intensity value over patch
-            const byteImage& I2,    // Image2
-            const doubleImage& I2M, // Image of mean intensity value over patch
-            int u1, int v1,         // Pixel of interest in image 1
-            int u2, int v2) {       // Pixel of interest in image 2
-    double var1 = correl(I1, I1M, I1, I1M, u1, v1, u1, v1);
-    if(var1 == 0)
-        return 0;
-    double var2 = correl(I2, I2M, I2, I2M, u2, v2, u2, v2);
-    if(var2 == 0)
-        return 0;
-    return correl(I1, I1M, I2, I2M, u1, v1, u2, v2) / sqrt(var1 * var2);
+/// Data term of all nodes of the graph: R[x+nx*y+(d-dmin)*nx*ny], computed
+/// in parallel over disparities.
+vector<float> cost_volume(const byteImage& I1, const byteImage& I2,
+                          int nx, int ny, int nd) {
+    PatchStats P1(I1,ny), P2(I2,ny);
+    vector<float> R(size_t(nx)*ny*nd);
+    Parallel::parallelFor(nd, [&](int k) {
+        cost_slice(I1, I2, P1, P2, nx, dmin+k, 0, ny, &R[size_t(nx)*ny*k]);
+    });
+    return R;
 }
 
 /// Create graph
@@ -182,13 +342,10 @@ double zncc(const byteImage& I1,    // Image 1
 /// The library assumes an edge consists of a pair of oriented edges, one in
 /// each direction. Put correct weights to the edges, such as 0, INF, or
 /// an intermediate weight.
-void build_graph(Graph<int,int,int>& G,
-                 const byteImage& I1, const byteImage& I2,
-                 int nx, int ny, int nd) {
-    const int INF=1000000; // "Infinite" value for edge impossible to cut
-    // Precompute images of mean intensity value over patch
-    doubleImage I1M = meanImage(I1), I2M = meanImage(I2);
-
+/// GraphT is the generic Graph<int,int,int> or the compact GridGraph.
+/// R is the data term of each node (see cost_volume).
+template <class GraphT>
+void build_graph(GraphT& G, const vector<float>& R, int nx, int ny, int nd) {
 
     G.add_node(nx*ny*nd);
         for (int x=0; x<nx; x++)
@@ -206,21 +363,7 @@ void build_graph(Graph<int,int,int>& G,
  {
      G.add_edge(nodeID,nodeID+nx,lambda, lambda);
  }
- float term,rho;
- //make sure that when we caculate zncc, our points won't be outside the pictures
- if(x*zoom>0 && x*zoom<I1.width()-win && x*zoom+d+dmin>0 && x*zoom+d+dmin < I2.width()-win)
- {
-      term = zncc(I1,I1M,I2,I2M,zoom*x+win,zoom*y+win, zoom*x+win+d, zoom*y+win);
- }
- else
-     term = 1;
- if(term<0)
- {
-     rho=1;}
-
- else
-
-     rho=sqrt(1-term);
+ float rho = R[nodeID];
  if(d==dmin)
  {
      G.add_tweights(x+nx*y,wcc*rho+1+(dmax-dmin)*lambda,0);}
@@ -242,18 +385,18 @@ void build_graph(Graph<int,int,int>& G,
 
 
 /// Extract disparity from minimum cut
-doubleImage decode_graph(Graph<int,int,int>& G, int nx, int ny, int nd) {
+template <class GraphT>
+doubleImage decode_graph(GraphT& G, int nx, int ny) {
     doubleImage D(nx,ny);
 
     //FMatrix<bool,nx,ny> D_bool;
-    cout<<"le type que ça sort "<<G.what_segment(nd*nx*ny)<<endl;
 
      for (int j=0; j<ny;j++){
      for (int i =0;i<nx;i++){
          //D_bool[i,j]=false;
            bool assertion =false;
          for (int d=dmin; d< dmax; d++){
-             if(assertion==false & G.what_segment(i+nx*j+(d-dmin)*nx*ny) ==  Graph<int,int,int>::SINK){
+             if(!assertion && G.what_segment(i+nx*j+(d-dmin)*nx*ny) ==  GraphT::SINK){
              D(i,j)=d;
 
              assertion = true;
@@ -265,19 +408,395 @@ doubleImage decode_graph(Graph<int,int,int>& G, int nx, int ny, int nd) {
     return D;
 }
     
+/// Build graph, compute minimum cut and extract disparity
+template <class GraphT>
+doubleImage disparity(GraphT& G, const byteImage& I1, const byteImage& I2,
+                      int nx, int ny, int nd, BenchReport& bench) {
+    const double work = double(nx)*ny*nd; // Graph nodes
+    cout << "Computing data term... " << flush;
+    bench.start("costs", work);
+    vector<float> R = cost_volume(I1, I2, nx, ny, nd);
+    bench.stop();
+    cout << "done" << endl;
+
+    cout << "Constructing graph... " << flush;
+    bench.start("graph", work);
+    build_graph(G, R, nx, ny, nd);
+    bench.stop();
+    cout << "done" << endl;
+
+    cout << "Computing minimum cut... " << flush;
+    bench.start("maxflow", work);
+    int f = G.maxflow();
+    bench.stop();
+    cout << "done" << endl << "  max flow = " << f << endl;
+
+    cout << "Extracting disparity map from minimum cut... " << flush;
+    doubleImage D=decode_graph(G, nx, ny);
+    cout << "done" << endl;
+    return D;
+}
+
+/// Row of the overlap of two consecutive strips where their disparities agree
+/// most (closest to y on ties). Rows less than half the overlap from y only,
+/// as cuts are less reliable near the borders of a strip. If the strips share
+/// no row, y itself: the seam is the strip border.
+int seam_row(const doubleImage& Da, int ya, // Upper strip, its first row
+             const doubleImage& Db, int yb, // Lower strip, its first row
+             int y, int overlap) {
+    int best=y, bestAgree=-1;
+    for(int k=0; k<=overlap/2; k++)
+        for(int s=-1; s<=1; s+=2) {
+            const int r = y+s*k;
+            if(r-ya>=Da.height() || r<yb)
+                continue;
+            int agree=0;
+            for(int x=0; x<Da.width(); x++)
+                agree += (Da(x,r-ya)==Db(x,r-yb));
+            if(agree > bestAgree) {
+                best = r;
+                bestAgree = agree;
+            }
+        }
+    return best;
+}
+
+/// Disparity by graph cuts on horizontal strips of the zoomed grid, solved in
+/// parallel, each with its own GridGraph: memory depends on the strip size,
+/// not on the image size. A strip of `strip` rows is extended by `overlap`
+/// rows on both sides. Consecutive strips are stitched at the row of their
+/// overlap where they agree most (see seam_row).
+doubleImage tiled_disparity(const byteImage& I1, const byteImage& I2,
+                            int nx, int ny, int nd, int strip, int overlap) {
+    const int n = (ny+strip-1)/strip;
+    vector<doubleImage> D(n); // Disparity of extended strips
+    vector<int> y0(n);        // First row of extended strips
+    for(int k=0; k<n; k++)
+        y0[k] = max(0, k*strip-overlap);
+    Parallel::parallelFor(n, [&](int k) {
+        const int h = min(ny, (k+1)*strip+overlap) - y0[k];
+        // Image rows seen by the patches of strip rows
+        const int w = I1.width(), rows = zoom*h+2*win;
+        byteImage S1 = I1.getSubImage(0, zoom*y0[k], w, rows);
+        byteImage S2 = I2.getSubImage(0, zoom*y0[k], I2.width(), rows);
+        GridGraph G(nx, h, nd);
+        build_graph(G, cost_volume(S1, S2, nx, h, nd), nx, h, nd);
+        G.maxflow();
+        D[k] = decode_graph(G, nx, h);
+    });
+    // Stitch strips
+    doubleImage Dt(nx,ny);
+    int agree=0, seams=0;
+    for(int k=0, r0=0; k<n; k++) {
+        int r1 = ny;
+        if(k+1 < n) {
+            r1 = seam_row(D[k], y0[k], D[k+1], y0[k+1], (k+1)*strip, overlap);
+            if(r1-y0[k] < D[k].height() && r1 >= y0[k+1]) { // Shared row
+                for(int x=0; x<nx; x++)
+                    agree += (D[k](x,r1-y0[k]) == D[k+1](x,r1-y0[k+1]));
+                seams += nx;
+            }
+        }
+        for(int y=r0; y<r1; y++)
+            for(int x=0; x<nx; x++)
+                Dt(x,y) = D[k](x,y-y0[k]);
+        r0 = r1;
+    }
+    cout << n << " strips, " << (seams? 100.0*agree/seams: 100.0)
+         << "% agreement at seams" << endl;
+    return Dt;
+}
+
+/// Energy of labeling L of the zoomed grid, given its data costs
+long long energy(const vector<int>& L, const vector<int>& cost, int nx, int ny) {
+    long long E=0;
+    for(int y=0, p=0; y<ny; y++)
+        for(int x=0; x<nx; x++, p++) {
+            E += cost[p];
+            if(x+1<nx) E += lambda*abs(L[p]-L[p+1]);
+            if(y+1<ny) E += lambda*abs(L[p]-L[p+nx]);
+        }
+    return E;
+}
+
+/// Disparity by alpha-expansion moves (Boykov, Veksler and Zabih, PAMI 2001)
+/// on the energy of build_graph: data term wcc*rho and smoothness lambda*|dp-dq|.
+/// Each move is a binary cut (keep label or switch to alpha) on a 2D
+/// GridGraph of nx*ny nodes. The same graph serves all moves: only the
+/// capacities that differ from the previous move are changed, and flow and
+/// search trees are reused.
+doubleImage expansion_disparity(const byteImage& I1, const byteImage& I2,
+                                int nx, int ny, int sweeps) {
+    PatchStats P1(I1,ny), P2(I2,ny);
+    const int n=nx*ny;
+    vector<int> L(n,dmin), cost(n), costA(n); // Labels and their data costs
+    vector<int> t(n,0), eR(n,0), eD(n,0); // Capacities of graph: src-sink,
+    vector<int> tn(n), eRn(n), eDn(n);    // right and down edges (new ones)
+    // Data cost of all pixels at disparity d, in parallel over row bands
+    vector<float> R(n);
+    const int bands = min(ny, 4*Parallel::pool().size());
+    auto data = [&](int d, vector<int>& c) {
+        Parallel::parallelFor(bands, [&](int b) {
+            cost_slice(I1, I2, P1, P2, nx, d, b*ny/bands, (b+1)*ny/bands,
+                       &R[0]);
+        });
+        for(int p=0; p<n; p++)
+            c[p] = int(wcc*R[p]);
+    };
+    data(dmin, cost);
+    GridGraph G(nx, ny, 1);
+    bool built=false;
+    for(int s=0; s<sweeps; s++) {
+        bool changed=false;
+        for(int alpha=dmin; alpha<dmax; alpha++) {
+            data(alpha, costA);
+            // Node sink side: switch to alpha. Pairwise term of p and q with
+            // A=V(Lp,Lq), B=V(Lp,alpha), C=V(alpha,Lq) is
+            // A + (C-A)xp - C xq + (B+C-A)(1-xp)xq (Kolmogorov and Zabih).
+            for(int p=0; p<n; p++)
+                tn[p] = costA[p]-cost[p];
+            for(int y=0, p=0; y<ny; y++)
+                for(int x=0; x<nx; x++, p++) {
+                    eRn[p] = eDn[p] = 0;
+                    for(int k=0; k<2; k++) {
+                        if((k==0 && x+1==nx) || (k==1 && y+1==ny))
+                            continue;
+                        const int q = p + (k? nx: 1);
+                        const int A=lambda*abs(L[p]-L[q]),
+                            B=lambda*abs(L[p]-alpha), C=lambda*abs(alpha-L[q]);
+                        tn[p] += C-A;
+                        tn[q] -= C;
+                        (k? eDn: eRn)[p] = B+C-A;
+                    }
+                }
+            for(int p=0; p<n; p++) {
+                const int dt = tn[p]-t[p];
+                if(! built)
+                    G.add_tweights(p, max(dt,0), max(-dt,0));
+                else if(dt != 0)
+                    G.change_tweights(p, dt, 0);
+                for(int k=0; k<2; k++) {
+                    const int de = (k? eDn[p]-eD[p]: eRn[p]-eR[p]);
+                    const int q = p + (k? nx: 1);
+                    if(! built && de>0)
+                        G.add_edge(p, q, de, 0);
+                    else if(built && de!=0)
+                        G.change_edge(p, q, de, 0);
+                }
+            }
+            t.swap(tn); eR.swap(eRn); eD.swap(eDn);
+            G.maxflow(built);
+            built = true;
+            for(int p=0; p<n; p++)
+                if(L[p]!=alpha && G.what_segment(p)==GridGraph::SINK) {
+                    L[p] = alpha;
+                    cost[p] = costA[p];
+                    changed = true;
+                }
+        }
+        cout << "  sweep " << s+1 << ": energy " << energy(L,cost,nx,ny)
+             << endl;
+        if(! changed)
+            break;
+    }
+    doubleImage D(nx,ny);
+    for(int y=0; y<ny; y++)
+        for(int x=0; x<nx; x++)
+            D(x,y) = L[x+nx*y];
+    return D;
+}
+
+/// Cost of padding disparities in SGM. Aggregated costs stay below
+/// sgmPad+wcc+P2, so P2 is at most sgmMaxP2 for them to fit in signed 16 bits.
+const int sgmPad = SHRT_MAX/2;
+const int sgmMaxP2 = SHRT_MAX-sgmPad-wcc;
+
+/// One step of SGM along a path: L = C + min(Lp, Lp(d-1)+P1, Lp(d+1)+P1,
+/// min(Lp)+P2) - min(Lp), and S += L. Lp has a sentinel before and after its
+/// n values (n multiple of 8). Return min(L).
+int sgm_step(const unsigned short* C, const unsigned short* Lp, int minLp,
+             int P1, int P2, int n, unsigned short* L, unsigned short* S) {
+#ifdef __SSE2__
+    // Values stay below 2^15: signed 16-bit min is correct
+    const __m128i p1=_mm_set1_epi16(short(P1)), m=_mm_set1_epi16(short(minLp));
+    const __m128i jump=_mm_set1_epi16(short(minLp+P2));
+    __m128i mins=_mm_set1_epi16(SHRT_MAX);
+    for(int k=0; k<n; k+=8) {
+        __m128i l = _mm_loadu_si128((const __m128i*)(Lp+k));
+        __m128i lm = _mm_loadu_si128((const __m128i*)(Lp+k-1));
+        __m128i lp = _mm_loadu_si128((const __m128i*)(Lp+k+1));
+        l = _mm_min_epi16(l, _mm_add_epi16(_mm_min_epi16(lm,lp), p1));
+        l = _mm_min_epi16(l, jump);
+        l = _mm_sub_epi16(_mm_add_epi16(l,
+                          _mm_loadu_si128((const __m128i*)(C+k))), m);
+        _mm_storeu_si128((__m128i*)(L+k), l);
+        __m128i s = _mm_loadu_si128((const __m128i*)(S+k));
+        _mm_storeu_si128((__m128i*)(S+k), _mm_adds_epu16(s,l));
+        mins = _mm_min_epi16(mins, l);
+    }
+    mins = _mm_min_epi16(mins, _mm_shuffle_epi32(mins, _MM_SHUFFLE(1,0,3,2)));
+    mins = _mm_min_epi16(mins, _mm_shuffle_epi32(mins, _MM_SHUFFLE(2,3,0,1)));
+    mins = _mm_min_epi16(mins, _mm_shufflelo_epi16(mins, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_extract_epi16(mins, 0);
+#else
+    int mins=SHRT_MAX;
+    for(int k=0; k<n; k++) {
+        int l = min(min(int(Lp[k]), min(Lp[k-1],Lp[k+1])+P1), minLp+P2);
+        L[k] = (unsigned short)(l + C[k] - minLp);
+        S[k] = (unsigned short)min(S[k]+L[k], USHRT_MAX);
+        mins = min(mins, int(L[k]));
+    }
+    return mins;
+#endif
+}
+
+/// Disparity by semi-global matching (Hirschmuller, PAMI 2008) with the data
+/// term wcc*rho of build_graph, penalty P1=lambda for disparity changes of 1
+/// and P2 for larger ones. Costs are aggregated along 4 or 8 directions. The
+/// lines of a direction are independent and processed in parallel. P2 is
+/// clamped to sgmMaxP2.
+doubleImage sgm_disparity(const byteImage& I1, const byteImage& I2,
+                          int nx, int ny, int nd, int paths, int P2) {
+    const int n=(nd+7)/8*8;               // Padded disparities of a pixel
+    const unsigned short BIG=sgmPad;      // Cost of padding
+    P2 = min(P2, sgmMaxP2);
+    vector<unsigned short> C(size_t(nx)*ny*n, BIG), S(C.size(), 0);
+    {   // Data term, disparities of a pixel contiguous
+        PatchStats P1(I1,ny), P2(I2,ny);
+        Parallel::parallelFor(nd, [&](int k) {
+            vector<float> R(nx*ny);
+            cost_slice(I1, I2, P1, P2, nx, dmin+k, 0, ny, &R[0]);
+            for(int p=0; p<nx*ny; p++)
+                C[size_t(p)*n+k] = (unsigned short)(wcc*R[p]);
+        });
+    }
+    const int dirs[8][2] = {{1,0},{-1,0},{0,1},{0,-1},
+                            {1,1},{-1,-1},{1,-1},{-1,1}};
+    for(int r=0; r<paths; r++) {
+        const int dx=dirs[r][0], dy=dirs[r][1];
+        // First pixels of the lines
+        vector<int> starts;
+        for(int y=0; y<ny; y++)
+            for(int x=0; x<nx; x++)
+                if(x-dx<0 || x-dx>=nx || y-dy<0 || y-dy>=ny)
+                    starts.push_back(x+nx*y);
+        const int tasks = min(int(starts.size()), 4*Parallel::pool().size());
+        Parallel::parallelFor(tasks, [&](int t) {
+            // Aggregated costs at previous and current pixel, with sentinels
+            vector<unsigned short> buf(2*(n+2), BIG);
+            unsigned short *Lp=&buf[1], *L=&buf[n+3];
+            const size_t b = starts.size();
+            for(size_t s=t*b/tasks; s<(t+1)*b/tasks; s++) {
+                int x=starts[s]%nx, y=starts[s]/nx, minLp=0;
+                fill(Lp, Lp+n, 0);
+                for(; x>=0 && x<nx && y>=0 && y<ny; x+=dx, y+=dy) {
+                    const size_t p=size_t(x+nx*y)*n;
+                    minLp = sgm_step(&C[p], Lp, minLp, lambda, P2, n, L, &S[p]);
+                    swap(Lp, L);
+                }
+            }
+        });
+    }
+    // Winner takes all
+    doubleImage D(nx,ny);
+    for(int y=0; y<ny; y++)
+        for(int x=0; x<nx; x++) {
+            const unsigned short* s = &S[size_t(x+nx*y)*n];
+            D(x,y) = dmin + int(min_element(s, s+nd)-s);
+        }
+    return D;
+}
+
+// Path of output file in directory dir (empty: source directory)
+string outPath(const string& dir, const string& name) {
+    return dir.empty()? string(srcPath(name.c_str())): dir+"/"+name;
+}
+
 // Load two rectified images.
 // Compute the disparity of image 2 w.r.t. image 1.
 // Display disparity map.
 // Display 3D mesh of corresponding depth map.
 int main(int argc, char* argv[]) {
-    if(argc!=1 && argc!=5) {
-        cerr << "Usage: " << argv[0] << " im1 im2 dmin dmax" << endl;
+    // Options (--name=value) come before positional arguments
+    string outDir;   // Output images (empty: source directory)
+    string jsonFile; // Stage timings
+    string plyFile;  // 3D mesh
+    bool adaptive=false;  // Quadtree mesh instead of two triangles per pixel
+    float planarity=1;    // Max disparity error of a quadtree leaf to its plane
+    float jump=2;         // Disparity range of a triangle tearing the mesh
+    bool generic=false; // Generic graph of maxflow/graph.h instead of grid
+    int strip=0;        // Rows of strips solved separately (0: whole image)
+    int overlap=8;      // Rows added on both sides of a strip
+    int nThreads=0;     // Threads for strips (0: all hardware threads)
+    string engine="ishikawa"; // Exact multi-label cut, expansion or sgm
+    int sweeps=5;       // Max number of sweeps over labels for expansion
+    int paths=8;        // Directions of SGM
+    int p2=8;           // SGM penalty of disparity jumps, in units of lambda
+    int a=1;
+    for(; a<argc && string(argv[a]).compare(0,2,"--")==0; a++) {
+        string opt(argv[a]);
+        if(opt.compare(0,6,"--out=")==0)
+            outDir = opt.substr(6);
+        else if(opt.compare(0,7,"--json=")==0)
+            jsonFile = opt.substr(7);
+        else if(opt.compare(0,6,"--ply=")==0)
+            plyFile = opt.substr(6);
+        else if(opt=="--mesh=grid" || opt=="--mesh=adaptive")
+            adaptive = (opt=="--mesh=adaptive");
+        else if(opt.compare(0,12,"--planarity=")==0)
+            planarity = stof(opt.substr(12));
+        else if(opt.compare(0,7,"--jump=")==0)
+            jump = stof(opt.substr(7));
+        else if(opt=="--graph=generic" || opt=="--graph=grid")
+            generic = (opt=="--graph=generic");
+        else if(opt.compare(0,7,"--zoom=")==0 && stoi(opt.substr(7))>0) {
+            zoom = stoi(opt.substr(7));
+            sigma = 6.0f/zoom;
+        } else if(opt.compare(0,8,"--strip=")==0)
+            strip = max(0, stoi(opt.substr(8)));
+        else if(opt.compare(0,10,"--overlap=")==0) {
+            overlap = stoi(opt.substr(10));
+            if(overlap < 1) {
+                cerr << "--overlap must be at least 1" << endl;
+                return 1;
+            }
+        } else if(opt.compare(0,10,"--threads=")==0)
+            nThreads = stoi(opt.substr(10));
+        else if(opt=="--engine=ishikawa" || opt=="--engine=expansion" ||
+                opt=="--engine=sgm")
+            engine = opt.substr(9);
+        else if(opt.compare(0,9,"--sweeps=")==0)
+            sweeps = stoi(opt.substr(9));
+        else if(opt=="--paths=4" || opt=="--paths=8")
+            paths = stoi(opt.substr(8));
+        else if(opt.compare(0,5,"--p2=")==0 && stoi(opt.substr(5))>=1) {
+            p2 = stoi(opt.substr(5));
+            if(p2 > sgmMaxP2/lambda) {
+                cerr << "--p2 must be at most " << sgmMaxP2/lambda << endl;
+                return 1;
+            }
+        }
+        else {
+            cerr << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    if(argc-a!=0 && argc-a!=4) {
+        cerr << "Usage: " << argv[0] << " [--out=dir] [--json=file] [--ply=file]"
+             << " [--mesh=grid|adaptive] [--planarity=t] [--jump=j]"
+             << " [--graph=grid|generic] [--zoom=n]"
+             << " [--strip=rows] [--overlap=rows] [--threads=n]"
+             << " [--engine=ishikawa|expansion|sgm] [--sweeps=n]"
+             << " [--paths=4|8] [--p2=n]"
+             << " im1 im2 dmin dmax" << endl;
         return 1;
     }
+    Parallel::pool(nThreads);
     const char *im1=DEF_im1, *im2=DEF_im2;
-    if(argc>1) {
-        im1 = argv[1]; im2=argv[2]; dmin=stoi(argv[3]); dmax=stoi(argv[4]);
+    if(argc>a) {
+        im1 = argv[a]; im2=argv[a+1]; dmin=stoi(argv[a+2]); dmax=stoi(argv[a+3]);
     }
+    BenchReport bench("GCDisparity");
     cout << "Loading images... " << flush;
     byteImage I1,I2;
     if(!load(I1, im1) || !load(I2,im2)) {
@@ -290,40 +809,98 @@ int main(int argc, char* argv[]) {
          << ", win="<<win << ", lambda="<<lambdaf << ", sigma="<<sigma
          << ", zoom="<<zoom << endl;
 
+    int w1=I1.width(), h=I1.height();
+#ifndef HEADLESS
     cout << "Displaying images... " << flush;
-    int w1=I1.width(), w2=I2.width(), h=I1.height();
-    openWindow(w1+w2, h);
+    openWindow(w1+I2.width(), h);
     display(I1); display(I2,w1,0);
     cout << "done" << endl;
+#endif
 
     // Zoomed image dim, disregarding borders (strips of width the patch radius)
     const int nx=(w1-2*win)/zoom, ny=(h-2*win)/zoom;
     const int nd=dmax-dmin; // Disparity range
 
-    cout << "Constructing graph (be patient)... " << flush;
-    Graph<int,int,int> G(nx*ny*nd,2*nx*ny*nd);
-    build_graph(G, I1, I2, nx, ny, nd);
-    cout << "done" << endl;
-
-    cout << "Computing minimum cut... " << flush;
-    int f = G.maxflow();
-    cout << "done" << endl << "  max flow = " << f << endl;
-
-    cout << "Extracting disparity map from minimum cut... " << flush;
-    doubleImage D=decode_graph(G, nx, ny, nd);
-    cout << "done" << endl;
+    doubleImage D;
+    if(engine == "sgm") {
+        cout << "Semi-global matching along " << paths << " paths... " << flush;
+        bench.start("sgm", double(nx)*ny*nd);
+        D = sgm_disparity(I1, I2, nx, ny, nd, paths, p2*lambda);
+        bench.stop();
+        cout << "done" << endl;
+    } else if(engine == "expansion") {
+        cout << "Alpha-expansion on " << nx << "x" << ny << " grid:" << endl;
+        bench.start("expansion", double(nx)*ny*nd);
+        D = expansion_disparity(I1, I2, nx, ny, sweeps);
+        bench.stop();
+    } else if(strip > 0) {
+        cout << "Graph cuts on strips of " << strip << "+2*" << overlap
+             << " rows... " << flush;
+        bench.start("strips", double(nx)*ny*nd);
+        D = tiled_disparity(I1, I2, nx, ny, nd, strip, overlap);
+        bench.stop();
+    } else if(generic) {
+        Graph<int,int,int> G(nx*ny*nd,2*nx*ny*nd);
+        D = disparity(G, I1, I2, nx, ny, nd, bench);
+    } else {
+        cout << "Grid graph: " << GridGraph::bytesPerNode() << " bytes/node, "
+             << (double(nx)*ny*nd*GridGraph::bytesPerNode())/(1<<20) << " MB"
+             << endl;
+        GridGraph G(nx, ny, nd);
+        D = disparity(G, I1, I2, nx, ny, nd, bench);
+    }
 
+#ifndef HEADLESS
     cout << "Displaying disparity map... " << flush;
     fillRect(0,0,w1,h,CYAN);
     display(enlarge(grey(D),zoom),win,win);
     cout << "done" << endl;
     cout << "Click to compute and display blured disparity map... " << flush;
     click();
+#else
+    save(enlarge(grey(D),zoom), outPath(outDir,"disparity.png"));
+#endif
     D=blur(D,sigma);
+#ifndef HEADLESS
     display(enlarge(grey(D),zoom),win,win);
     cout << "done" << endl;
+#else
+    save(enlarge(grey(D),zoom), outPath(outDir,"disparity_blur.png"));
+#endif
 
-    show3D(I1.getSubImage(win,win,w1-2*win,h-2*win), D, zoom);
+    const byteImage I = I1.getSubImage(win,win,w1-2*win,h-2*win);
+    QuadMesh::Mesh mesh;
+    if(adaptive) {
+        cout << "Adaptive mesh... " << flush;
+        bench.start("mesh", double(nx)*ny);
+        mesh = QuadMesh::build(D, planarity, jump);
+        bench.stop();
+        cout << mesh.face.size()/3 << " triangles instead of "
+             << 2*(nx-1)*(ny-1) << endl;
+    }
+#ifndef HEADLESS
+    if(! adaptive) // For the 3D window
+        mesh = QuadMesh::regular(nx, ny);
+#endif
+
+    if(! plyFile.empty()) {
+        cout << "Writing 3D mesh... " << flush;
+        bench.start("ply", double(nx)*ny);
+        const bool written = adaptive? writePLY(plyFile, I, D, zoom, mesh):
+                                       writePLY(plyFile, I, D, zoom);
+        bench.stop();
+        if(written)
+            cout << "done" << endl;
+        else
+            cerr << "Error writing " << plyFile << endl;
+    }
+
+    if(! jsonFile.empty() && ! bench.write(jsonFile))
+        cerr << "Error writing " << jsonFile << endl;
+
+#ifndef HEADLESS
+    show3D(I, D, zoom, mesh);
     endGraphics();
+#endif
     return 0;
 }
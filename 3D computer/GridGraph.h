@@ -0,0 +1,480 @@
+// Imagine++ project
+// Project:  GraphCutsDisparity
+// Max-flow on a regular 3D grid graph of nx*ny*nd nodes, with the same
+// interface as the generic Graph of maxflow/graph.h for what GCDisparity uses.
+// Arcs are not stored: the neighbors of node i in directions +x,-x,+y,-y,+d,-d
+// are i+1, i-1, i+nx, i-nx, i+nx*ny, i-nx*ny. Only residual capacities are
+// kept, on 16 bits for x/y arcs and 32 bits for d arcs and terminals, with a
+// few bytes of search tree per node. Flow is computed with the algorithm of
+// Boykov and Kolmogorov (PAMI 2004), as in maxflow/graph.h.
+// Capacities can be changed after maxflow() and the flow recomputed from the
+// residual graph and search trees of the previous one (Kohli and Torr,
+// "Dynamic graph cuts", PAMI 2007).
+
+#ifndef GRIDGRAPH_H
+#define GRIDGRAPH_H
+
+#include <cassert>
+#include <climits>
+#include <deque>
+#include <vector>
+
+class GridGraph {
+public:
+    enum termtype { SOURCE=0, SINK=1 };
+    typedef int node_id;
+
+    GridGraph(int nx, int ny, int nd);
+    /// Nodes are all created by the constructor: only check their number.
+    node_id add_node(int n=1) { assert(n == int(tr.size())); return 0; }
+    /// Add edge i->j with capacity cap and j->i with capacity rev_cap. The
+    /// nodes must be neighbors in the grid, with j after i.
+    void add_edge(node_id i, node_id j, int cap, int rev_cap);
+    /// Add capacities of edges source->i and i->sink.
+    void add_tweights(node_id i, int cap_source, int cap_sink);
+    /// Add dcap to capacity of edge i->j and drev to j->i after maxflow().
+    /// Deltas may be negative, as long as capacities stay nonnegative.
+    void change_edge(node_id i, node_id j, int dcap, int drev);
+    /// Add dsrc to capacity of source->i and dsink to i->sink after maxflow()
+    /// (deltas may be negative).
+    void change_tweights(node_id i, int dsrc, int dsink);
+    /// Compute maximum flow, return its value. With reuse_trees, start from
+    /// the flow and trees of previous call, updated by the changes since.
+    /// The flow value is then only meaningful up to a constant.
+    int maxflow(bool reuse_trees=false);
+    /// Side of node i in minimum cut (free nodes go with default_segm).
+    termtype what_segment(node_id i, termtype default_segm=SOURCE) const;
+    /// Bytes of memory per node
+    static int bytesPerNode();
+
+private:
+    enum { NONE=-1, TERMINAL=6, ORPHAN=7 }; // Special parent values
+    int neighbor(int i, int dir) const { return i+offset[dir]; }
+    bool hasNeighbor(int i, int dir) const { return (mask[i]>>dir)&1; }
+    /// Residual capacity of arc from i in direction dir
+    int rcap(int i, int dir) const {
+        return (dir<4)? rcXY[4*i+dir]: rcD[2*i+dir-4];
+    }
+    void setRcap(int i, int dir, int c) {
+        if(dir<4) rcXY[4*i+dir]=short(c); else rcD[2*i+dir-4]=c;
+    }
+    int direction(int i, int j) const; // Direction of neighbor j of i
+    void mark(int i); // Node whose capacities changed since last maxflow()
+    void reuseTrees();
+    void push(int i, int dir, int f); // Send f along arc and update reverse
+    void setActive(int i);
+    int nextActive();
+    void augment(int i, int dir);
+    void processOrphan(int i);
+
+    int nx, ny, nd;
+    int offset[6];
+    std::vector<short> rcXY;      ///< Residual capacities, 4 per node
+    std::vector<int> rcD;         ///< Residual capacities, 2 per node
+    std::vector<int> tr;          ///< Source (>0) or sink (<0) residual
+    std::vector<signed char> parent; ///< Direction of parent in search tree
+    std::vector<unsigned char> sink; ///< In sink tree
+    std::vector<unsigned char> mask; ///< Existing neighbors (bit per dir)
+    std::vector<int> next;        ///< Next active node (itself if last)
+    std::vector<int> ts, dist;    ///< Timestamp and distance to terminal
+    std::vector<bool> marked;     ///< In list of changed nodes
+    int first, last;              ///< Queue of active nodes
+    int markFirst, markLast;      ///< List of changed nodes (through next)
+    std::deque<int> orphans;
+    int time;
+    int flow;
+};
+
+inline GridGraph::GridGraph(int nx0, int ny0, int nd0)
+: nx(nx0), ny(ny0), nd(nd0), first(-1), last(-1), markFirst(-1), markLast(-1),
+  time(0), flow(0) {
+    const int n=nx*ny*nd;
+    const int off[6] = {1, -1, nx, -nx, nx*ny, -nx*ny};
+    for(int k=0; k<6; k++)
+        offset[k] = off[k];
+    rcXY.assign(4*n, 0);
+    if(nd > 1) // No d arcs in 2D
+        rcD.assign(2*n, 0);
+    tr.assign(n, 0);
+    parent.assign(n, NONE);
+    sink.assign(n, 0);
+    mask.assign(n, 0);
+    next.assign(n, -1);
+    ts.assign(n, 0);
+    dist.assign(n, 0);
+    marked.assign(n, false);
+    for(int d=0, i=0; d<nd; d++)
+        for(int y=0; y<ny; y++)
+            for(int x=0; x<nx; x++, i++)
+                mask[i] = (x+1<nx) | (x>0)<<1 | (y+1<ny)<<2 | (y>0)<<3 |
+                          (d+1<nd)<<4 | (d>0)<<5;
+}
+
+inline int GridGraph::bytesPerNode() {
+    return 4*sizeof(short) + 2*sizeof(int) + sizeof(int) + 3 + 3*sizeof(int);
+}
+
+inline int GridGraph::direction(int i, int j) const {
+    int dir=0;
+    while(dir<6 && (offset[dir]!=j-i || ! hasNeighbor(i,dir)))
+        dir += 2;
+    assert(dir<6 && hasNeighbor(i,dir));
+    return dir;
+}
+
+inline void GridGraph::add_edge(node_id i, node_id j, int cap, int rev_cap) {
+    const int dir = direction(i,j);
+    if(dir<4) {
+        assert(rcXY[4*i+dir]+cap <= SHRT_MAX/2 &&
+               rcXY[4*j+dir+1]+rev_cap <= SHRT_MAX/2);
+        rcXY[4*i+dir] += cap;
+        rcXY[4*j+dir+1] += rev_cap;
+    } else {
+        rcD[2*i] += cap;
+        rcD[2*j+1] += rev_cap;
+    }
+}
+
+inline void GridGraph::add_tweights(node_id i, int cap_source, int cap_sink) {
+    int delta = tr[i];
+    if(delta > 0)
+        cap_source += delta;
+    else
+        cap_sink -= delta;
+    flow += (cap_source < cap_sink)? cap_source: cap_sink;
+    tr[i] = cap_source - cap_sink;
+}
+
+inline void GridGraph::mark(int i) {
+    if(marked[i])
+        return;
+    marked[i] = true;
+    if(markLast >= 0)
+        next[markLast] = i;
+    else
+        markFirst = i;
+    markLast = i;
+    next[i] = i;
+}
+
+inline void GridGraph::change_edge(node_id i, node_id j, int dcap, int drev) {
+    const int dir = direction(i,j);
+    int r = rcap(i,dir)+dcap, rev = rcap(j,dir^1)+drev;
+    // Flow above new capacity: send the excess back through the terminals,
+    // which keeps the sum of residuals (the sum of capacities) of the arcs.
+    if(r < 0) {
+        rev += r;
+        tr[i] -= r;
+        tr[j] += r;
+        r = 0;
+    } else if(rev < 0) {
+        r += rev;
+        tr[j] -= rev;
+        tr[i] += rev;
+        rev = 0;
+    }
+    assert(r>=0 && rev>=0 && (dir>=4 || r+rev<=SHRT_MAX));
+    setRcap(i, dir, r);
+    setRcap(j, dir^1, rev);
+    mark(i);
+    mark(j);
+}
+
+inline void GridGraph::change_tweights(node_id i, int dsrc, int dsink) {
+    tr[i] += dsrc-dsink;
+    mark(i);
+}
+
+inline void GridGraph::push(int i, int dir, int f) {
+    const int j = neighbor(i,dir);
+    if(dir<4) {
+        rcXY[4*i+dir] -= f;
+        rcXY[4*j+(dir^1)] += f;
+    } else {
+        rcD[2*i+dir-4] -= f;
+        rcD[2*j+(dir^1)-4] += f;
+    }
+}
+
+inline void GridGraph::setActive(int i) {
+    if(next[i] >= 0)
+        return;
+    if(last >= 0)
+        next[last] = i;
+    else
+        first = i;
+    last = i;
+    next[i] = i;
+}
+
+inline int GridGraph::nextActive() {
+    while(first >= 0) {
+        const int i = first;
+        first = (next[i]==i)? -1: next[i];
+        if(first < 0)
+            last = -1;
+        next[i] = -1;
+        if(parent[i] != NONE)
+            return i;
+    }
+    return -1;
+}
+
+inline GridGraph::termtype
+GridGraph::what_segment(node_id i, termtype default_segm) const {
+    if(parent[i] == NONE)
+        return default_segm;
+    return sink[i]? SINK: SOURCE;
+}
+
+/// Augment along path through arc from i (source tree) in direction dir.
+inline void GridGraph::augment(int i0, int dir0) {
+    const int j0 = neighbor(i0,dir0);
+    // Bottleneck capacity
+    int b = rcap(i0,dir0);
+    for(int i=i0; ; ) { // Source tree
+        const int a = parent[i];
+        if(a == TERMINAL) {
+            if(tr[i] < b) b = tr[i];
+            break;
+        }
+        const int p = neighbor(i,a);
+        if(rcap(p,a^1) < b) b = rcap(p,a^1);
+        i = p;
+    }
+    for(int i=j0; ; ) { // Sink tree
+        const int a = parent[i];
+        if(a == TERMINAL) {
+            if(-tr[i] < b) b = -tr[i];
+            break;
+        }
+        if(rcap(i,a) < b) b = rcap(i,a);
+        i = neighbor(i,a);
+    }
+    // Push flow
+    push(i0, dir0, b);
+    for(int i=i0; ; ) {
+        const int a = parent[i];
+        if(a == TERMINAL) {
+            tr[i] -= b;
+            if(tr[i] == 0) {
+                parent[i] = ORPHAN;
+                orphans.push_front(i);
+            }
+            break;
+        }
+        const int p = neighbor(i,a);
+        push(p, a^1, b);
+        if(rcap(p,a^1) == 0) {
+            parent[i] = ORPHAN;
+            orphans.push_front(i);
+        }
+        i = p;
+    }
+    for(int i=j0; ; ) {
+        const int a = parent[i];
+        if(a == TERMINAL) {
+            tr[i] += b;
+            if(tr[i] == 0) {
+                parent[i] = ORPHAN;
+                orphans.push_front(i);
+            }
+            break;
+        }
+        const int p = neighbor(i,a);
+        push(i, a, b);
+        if(rcap(i,a) == 0) {
+            parent[i] = ORPHAN;
+            orphans.push_front(i);
+        }
+        i = p;
+    }
+    flow += b;
+}
+
+/// Find a new parent for orphan i, or make it free.
+inline void GridGraph::processOrphan(int i) {
+    const bool s = sink[i];
+    int best=NONE, dmin=INT_MAX;
+    for(int dir=0; dir<6; dir++) {
+        if(! hasNeighbor(i,dir))
+            continue;
+        int j = neighbor(i,dir);
+        // Residual capacity from parent to child in source tree, from child
+        // to parent in sink tree
+        if((s? rcap(i,dir): rcap(j,dir^1)) == 0 ||
+           parent[j]==NONE || sink[j]!=s)
+            continue;
+        // Check that j is rooted at a terminal, with distance d
+        int d=0;
+        while(true) {
+            if(ts[j] == time) {
+                d += dist[j];
+                break;
+            }
+            const int a = parent[j];
+            d++;
+            if(a == TERMINAL) {
+                ts[j] = time;
+                dist[j] = 1;
+                break;
+            }
+            if(a == ORPHAN) {
+                d = INT_MAX;
+                break;
+            }
+            j = neighbor(j,a);
+        }
+        if(d == INT_MAX)
+            continue;
+        if(d < dmin) {
+            best = dir;
+            dmin = d;
+        }
+        // Set marks along the path
+        for(j=neighbor(i,dir); ts[j]!=time; j=neighbor(j,parent[j])) {
+            ts[j] = time;
+            dist[j] = d--;
+        }
+    }
+    if(best != NONE) {
+        parent[i] = best;
+        ts[i] = time;
+        dist[i] = dmin+1;
+        return;
+    }
+    // No parent: i becomes free, its children are orphans
+    for(int dir=0; dir<6; dir++) {
+        if(! hasNeighbor(i,dir))
+            continue;
+        const int j = neighbor(i,dir);
+        const int a = parent[j];
+        if(a==NONE || sink[j]!=s)
+            continue;
+        if((s? rcap(i,dir): rcap(j,dir^1)) > 0)
+            setActive(j);
+        if(a!=TERMINAL && a!=ORPHAN && neighbor(j,a)==i) {
+            parent[j] = ORPHAN;
+            orphans.push_back(j);
+        }
+    }
+    parent[i] = NONE;
+}
+
+/// Restore search trees after capacity changes: changed nodes are attached
+/// to their terminal or made orphans.
+inline void GridGraph::reuseTrees() {
+    ++time;
+    while(markFirst >= 0) {
+        const int i = markFirst;
+        markFirst = (next[i]==i)? -1: next[i];
+        next[i] = -1;
+        marked[i] = false;
+        setActive(i);
+        if(tr[i] == 0) {
+            if(parent[i] != NONE) {
+                parent[i] = ORPHAN;
+                orphans.push_back(i);
+            }
+            continue;
+        }
+        const bool s = (tr[i] < 0);
+        if(parent[i]==NONE || sink[i]!=s) {
+            // Children of i in its former tree become orphans, neighbors in
+            // the other tree may grow to i.
+            for(int dir=0; dir<6; dir++) {
+                if(! hasNeighbor(i,dir))
+                    continue;
+                const int j = neighbor(i,dir);
+                const int a = parent[j];
+                if(marked[j] || a==NONE)
+                    continue;
+                if(a!=TERMINAL && a!=ORPHAN && neighbor(j,a)==i) {
+                    parent[j] = ORPHAN;
+                    orphans.push_back(j);
+                }
+                if(sink[j]!=s && (s? rcap(j,dir^1): rcap(i,dir)) > 0)
+                    setActive(j);
+            }
+            sink[i] = s;
+        }
+        parent[i] = TERMINAL;
+        ts[i] = time;
+        dist[i] = 1;
+    }
+    markLast = -1;
+    while(! orphans.empty()) {
+        const int o = orphans.front();
+        orphans.pop_front();
+        processOrphan(o);
+    }
+}
+
+inline int GridGraph::maxflow(bool reuse_trees) {
+    const int n = int(tr.size());
+    if(reuse_trees)
+        reuseTrees();
+    else
+        for(int i=0; i<n; i++) {
+            next[i] = -1;
+            ts[i] = time;
+            if(tr[i] != 0) {
+                sink[i] = (tr[i] < 0);
+                parent[i] = TERMINAL;
+                dist[i] = 1;
+                setActive(i);
+            } else
+                parent[i] = NONE;
+        }
+    int i=-1; // Current node
+    while(true) {
+        if(i<0 || parent[i]==NONE) {
+            i = nextActive();
+            if(i < 0)
+                break;
+        }
+        // Grow tree of i, stop at an arc to the other tree
+        int meet=NONE;
+        const bool s = sink[i];
+        for(int dir=0; dir<6 && meet==NONE; dir++) {
+            if(! hasNeighbor(i,dir) ||
+               (s? rcap(neighbor(i,dir),dir^1): rcap(i,dir)) == 0)
+                continue;
+            const int j = neighbor(i,dir);
+            if(parent[j] == NONE) {
+                sink[j] = s;
+                parent[j] = dir^1;
+                ts[j] = ts[i];
+                dist[j] = dist[i]+1;
+                setActive(j);
+            } else if(sink[j] != s)
+                meet = dir;
+            else if(ts[j] <= ts[i] && dist[j] > dist[i]) {
+                // Shorter path to terminal through i
+                parent[j] = dir^1;
+                ts[j] = ts[i];
+                dist[j] = dist[i]+1;
+            }
+        }
+        ++time;
+        if(meet == NONE) {
+            i = -1;
+            continue;
+        }
+        // Keep i active for next iteration
+        next[i] = i;
+        if(s)
+            augment(neighbor(i,meet), meet^1);
+        else
+            augment(i, meet);
+        while(! orphans.empty()) {
+            const int o = orphans.front();
+            orphans.pop_front();
+            processOrphan(o);
+        }
+        next[i] = -1;
+    }
+    return flow;
+}
+
+#endif
@@ -0,0 +1,226 @@
+// Imagine++ project
+// Project:  Panorama
+// Robust estimation of a homography from point matches: RANSAC on samples of
+// 4 matches, each solved exactly in an 8x8 system on the stack, followed by a
+// least squares fit on the inliers. Coordinates are scaled by 0.001 for
+// conditioning. Matrices are 3x3 by rows, in double.
+
+#ifndef HOMOGRAPHY_H
+#define HOMOGRAPHY_H
+
+#include "Parallel.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace Homography {
+
+typedef std::array<double,9> Mat3; ///< 3x3 matrix by rows
+
+inline Mat3 identity() {
+    Mat3 I = {{1,0,0, 0,1,0, 0,0,1}};
+    return I;
+}
+
+/// Matrix product A*B
+inline Mat3 product(const Mat3& A, const Mat3& B) {
+    Mat3 C;
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+            C[3*i+j] = A[3*i]*B[j] + A[3*i+1]*B[3+j] + A[3*i+2]*B[6+j];
+    return C;
+}
+
+/// Inverse of A in B, normalized so that B[8]=1 when possible. Return false if
+/// A is singular.
+inline bool inverse(const Mat3& A, Mat3& B) {
+    B[0]=A[4]*A[8]-A[5]*A[7]; B[1]=A[2]*A[7]-A[1]*A[8]; B[2]=A[1]*A[5]-A[2]*A[4];
+    B[3]=A[5]*A[6]-A[3]*A[8]; B[4]=A[0]*A[8]-A[2]*A[6]; B[5]=A[2]*A[3]-A[0]*A[5];
+    B[6]=A[3]*A[7]-A[4]*A[6]; B[7]=A[1]*A[6]-A[0]*A[7]; B[8]=A[0]*A[4]-A[1]*A[3];
+    const double det = A[0]*B[0] + A[1]*B[3] + A[2]*B[6];
+    if(det == 0)
+        return false;
+    const double s = (B[8]!=0)? 1/B[8]: 1/det;
+    for(int k=0; k<9; k++)
+        B[k] *= s;
+    return true;
+}
+
+/// Point match (x1,y1) in image 1, (x2,y2) in image 2
+struct Match {
+    float x1, y1, x2, y2;
+};
+
+/// Solve the n x n system A x = b (A by rows) by Gaussian elimination with
+/// partial pivoting. A and b are overwritten, x is put in b. Return false if
+/// A is singular.
+inline bool solve(double* A, double* b, int n) {
+    for(int c=0; c<n; c++) {
+        int p=c;
+        for(int i=c+1; i<n; i++)
+            if(std::fabs(A[i*n+c]) > std::fabs(A[p*n+c]))
+                p = i;
+        if(std::fabs(A[p*n+c]) < 1e-12)
+            return false;
+        if(p != c) {
+            for(int j=c; j<n; j++)
+                std::swap(A[c*n+j], A[p*n+j]);
+            std::swap(b[c], b[p]);
+        }
+        for(int i=c+1; i<n; i++) {
+            const double f = A[i*n+c]/A[c*n+c];
+            for(int j=c; j<n; j++)
+                A[i*n+j] -= f*A[c*n+j];
+            b[i] -= f*b[c];
+        }
+    }
+    for(int i=n-1; i>=0; i--) {
+        for(int j=i+1; j<n; j++)
+            b[i] -= A[i*n+j]*b[j];
+        b[i] /= A[i*n+i];
+    }
+    return true;
+}
+
+/// The two rows of the linear system in h (H by rows, H[8]=1) given by match
+/// m, coordinates scaled by 0.001; right-hand sides in r.
+inline void rows(const Match& m, double a[2][8], double r[2]) {
+    const double x=0.001*m.x1, y=0.001*m.y1, u=0.001*m.x2, v=0.001*m.y2;
+    const double a0[8]={x,y,1,0,0,0,-u*x,-u*y}, a1[8]={0,0,0,x,y,1,-v*x,-v*y};
+    for(int k=0; k<8; k++) {
+        a[0][k] = a0[k];
+        a[1][k] = a1[k];
+    }
+    r[0]=u; r[1]=v;
+}
+
+/// Homography in pixel coordinates from solution h of the scaled system
+inline Mat3 unscale(const double h[8]) {
+    Mat3 H = {{h[0], h[1], 1000*h[2],
+               h[3], h[4], 1000*h[5],
+               0.001*h[6], 0.001*h[7], 1}};
+    return H;
+}
+
+/// Homography mapping x1 to x2 for the matches of indices idx[0..n-1]: exact
+/// for n=4, least squares for n>4. Return false if degenerate.
+inline bool fit(const std::vector<Match>& m, const int* idx, int n, Mat3& H) {
+    double A[8*8], b[8];
+    double a[2][8], r[2];
+    if(n == 4) {
+        for(int k=0; k<4; k++) {
+            rows(m[idx[k]], a, r);
+            for(int t=0; t<2; t++) {
+                for(int j=0; j<8; j++)
+                    A[(2*k+t)*8+j] = a[t][j];
+                b[2*k+t] = r[t];
+            }
+        }
+    } else { // Normal equations
+        for(int j=0; j<64; j++) A[j]=0;
+        for(int j=0; j<8; j++) b[j]=0;
+        for(int k=0; k<n; k++) {
+            rows(m[idx[k]], a, r);
+            for(int t=0; t<2; t++)
+                for(int i=0; i<8; i++) {
+                    for(int j=0; j<8; j++)
+                        A[i*8+j] += a[t][i]*a[t][j];
+                    b[i] += a[t][i]*r[t];
+                }
+        }
+    }
+    if(! solve(A, b, 8))
+        return false;
+    H = unscale(b);
+    return true;
+}
+
+/// Squared transfer error of match m by H, in pixels. Points mapped to
+/// infinity or behind the camera (w<=0) get infinite error.
+inline float transferError(const Mat3& H, const Match& m) {
+    const double w = H[6]*m.x1 + H[7]*m.y1 + H[8];
+    if(w <= 0)
+        return INFINITY;
+    const double u = (H[0]*m.x1 + H[1]*m.y1 + H[2])/w - m.x2;
+    const double v = (H[3]*m.x1 + H[4]*m.y1 + H[5])/w - m.y2;
+    return float(u*u + v*v);
+}
+
+/// Parameters of estimate
+struct Options {
+    float distMax; ///< Transfer error (pixels) for inliers
+    float beta;    ///< Probability of failure
+    int maxIter;
+    int minInliers; ///< Fewer is a failure
+    Options(): distMax(3), beta(0.01f), maxIter(10000), minInliers(12) {}
+};
+
+/// Homography H mapping image 1 to image 2 by RANSAC on matches m, with
+/// random stream seed. Inliers are put in inliers. Return false if there are
+/// fewer than opt.minInliers.
+inline bool estimate(const std::vector<Match>& m, Mat3& H,
+                     std::vector<int>& inliers, uint64_t seed,
+                     const Options& opt=Options()) {
+    const int n = int(m.size());
+    inliers.clear();
+    if(n < 4 || n < opt.minInliers)
+        return false;
+    const float d2 = opt.distMax*opt.distMax;
+    Parallel::CounterRNG rng(seed, 0);
+    int best=0, iterations=opt.maxIter;
+    for(int it=0; it<iterations; it++) {
+        int s[4];
+        for(int k=0; k<4; k++) { // Distinct indices
+            bool fresh;
+            do {
+                s[k] = rng(n);
+                fresh = true;
+                for(int l=0; l<k; l++)
+                    fresh = fresh && s[l]!=s[k];
+            } while(! fresh);
+        }
+        Mat3 G;
+        if(! fit(m, s, 4, G))
+            continue;
+        int count=0;
+        for(int i=0; i<n && count+(n-i)>best; i++) // Stop when cannot win
+            count += transferError(G, m[i]) < d2;
+        if(count > best) {
+            best = count;
+            H = G;
+            const double p = std::pow(double(best)/n, 4);
+            if(p >= 1)
+                iterations = 0;
+            else {
+                const double k = std::ceil(std::log(opt.beta)/std::log1p(-p));
+                if(k < iterations)
+                    iterations = int(k);
+            }
+        }
+    }
+    if(best < opt.minInliers)
+        return false;
+    // Least squares on inliers, as long as it does not lose inliers
+    Mat3 previous = H;
+    for(int pass=0; pass<3; pass++) {
+        std::vector<int> in;
+        for(int i=0; i<n; i++)
+            if(transferError(H, m[i]) < d2)
+                in.push_back(i);
+        if(in.size() < inliers.size()) {
+            H = previous;
+            break;
+        }
+        inliers.swap(in);
+        previous = H;
+        if(pass==2 || ! fit(m, &inliers[0], int(inliers.size()), H))
+            break;
+    }
+    return int(inliers.size()) >= opt.minInliers;
+}
+
+} // namespace Homography
+
+#endif
@@ -3,14 +3,30 @@
 // Author:   Pascal Monasse
 // Date:     2013/10/08
 
+#include "./Imagine/Features.h"
 #include <Imagine/Graphics.h>
 #include <Imagine/Images.h>
 #include <Imagine/LinAlg.h>
+#include "Bench.h"
+#include "Blend.h"
+#include "Homography.h"
+#include "Parallel.h"
+#include "SiftMatch.h"
+#include "TileStore.h"
+#include "Warp.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <vector>
 #include <sstream>
+#include <fstream>
+#include <dirent.h>
+#include <sys/stat.h>
 using namespace Imagine;
 using namespace std;
+using Homography::Mat3;
 
+#ifndef HEADLESS
 // Record clicks in two images, until right button click
 void getClicks(Window w1, Window w2,
                vector<IntPoint2>& pts1, vector<IntPoint2>& pts2) {
@@ -28,8 +44,19 @@ for(size_t i=0; i<8; i++) {
   }
 
 }
-
-
+#endif
+
+// Read point matches from text file, one "x1 y1 x2 y2" per line
+bool loadPoints(const string& fileName,
+                vector<IntPoint2>& pts1, vector<IntPoint2>& pts2) {
+    ifstream f(fileName.c_str());
+    int x1, y1, x2, y2;
+    while(f >> x1 >> y1 >> x2 >> y2) {
+        pts1.push_back(IntPoint2(x1,y1));
+        pts2.push_back(IntPoint2(x2,y2));
+    }
+    return f.eof() && !pts1.empty();
+}
 
 // Return homography compatible with point matches
 Matrix<float> getHomography(const vector<IntPoint2>& pts1,
@@ -75,92 +102,397 @@ void growTo(float& x0, float& y0, float& x1, float& y1, float x, float y) {
     if(y>y1) y1=y;    
 }
 
-// Panorama construction
-void panorama(const Image<Color,2>& I1, const Image<Color,2>& I2,
-              Matrix<float> H) {
-    Vector<float> v(3);
-    float x0=0, y0=0, x1=I2.width(), y1=I2.height();
-
-    v[0]=0; v[1]=0; v[2]=1;
-    v=H*v; v/=v[2];
-    growTo(x0, y0, x1, y1, v[0], v[1]);
-
-    v[0]=I1.width(); v[1]=0; v[2]=1;
-    v=H*v; v/=v[2];
-    growTo(x0, y0, x1, y1, v[0], v[1]);
+// Corners (x[k],y[k]) of I mapped by H, in order around the image
+void footprint(const Image<Color>& I, const Mat3& H, float x[4], float y[4]) {
+    const double cx[4]={0, double(I.width()), double(I.width()), 0};
+    const double cy[4]={0, 0, double(I.height()), double(I.height())};
+    for(int k=0; k<4; k++) {
+        const double w = H[6]*cx[k] + H[7]*cy[k] + H[8];
+        x[k] = float((H[0]*cx[k] + H[1]*cy[k] + H[2])/w);
+        y[k] = float((H[3]*cx[k] + H[4]*cy[k] + H[5])/w);
+    }
+}
 
-    v[0]=I1.width(); v[1]=I1.height(); v[2]=1;
-    v=H*v; v/=v[2];
-    growTo(x0, y0, x1, y1, v[0], v[1]);
+// Does the convex quadrilateral (qx,qy) meet rectangle [x0,x1]x[y0,y1]?
+// Separating axis test, on the axes of the rectangle and the edges of the quad
+bool intersects(const float qx[4], const float qy[4],
+                float x0, float y0, float x1, float y1) {
+    if(*max_element(qx,qx+4)<x0 || *min_element(qx,qx+4)>x1 ||
+       *max_element(qy,qy+4)<y0 || *min_element(qy,qy+4)>y1)
+        return false;
+    const float rx[4]={x0,x1,x1,x0}, ry[4]={y0,y0,y1,y1};
+    for(int k=0; k<4; k++) {
+        const float nx=qy[(k+1)%4]-qy[k], ny=qx[k]-qx[(k+1)%4]; // Edge normal
+        const float side = nx*(qx[(k+2)%4]-qx[k]) + ny*(qy[(k+2)%4]-qy[k]);
+        bool separated=true;
+        for(int c=0; c<4 && separated; c++)
+            separated = (nx*(rx[c]-qx[k]) + ny*(ry[c]-qy[k]))*side < 0;
+        if(separated)
+            return false;
+    }
+    return true;
+}
 
-    v[0]=0; v[1]=I1.height(); v[2]=1;
-    v=H*v; v/=v[2];
-    growTo(x0, y0, x1, y1, v[0], v[1]);
+// Image of the panorama warped into the frame of the reference
+struct Source {
+    const Image<Color>* I;
+    Mat3 s;              // Homography from the reference frame to I
+    float qx[4], qy[4];  // Footprint of I in the reference frame
+};
+
+// Geometry of the panorama, in the frame of the reference image, and blending
+struct Frame {
+    int ox, oy;          // Origin, integer so that the reference is not resampled
+    int w, h;            // Dimensions
+    const Image<Color>* ref;
+    vector<Source> src;  // Other images
+    Blend::Mode blend;   // Blending of overlapping images
+};
+
+// Frame of the panorama of reference image ref and images I[k], mapped into
+// the reference by H[k]
+Frame frame(const Image<Color>& ref, const vector<const Image<Color>*>& I,
+            const vector<Mat3>& H) {
+    Frame f;
+    f.ref = &ref;
+    f.blend = Blend::MEAN;
+    float x0=0, y0=0, x1=ref.width(), y1=ref.height();
+    for(size_t i=0; i<I.size(); i++) {
+        Source src;
+        src.I = I[i];
+        footprint(*I[i], H[i], src.qx, src.qy);
+        for(int k=0; k<4; k++)
+            growTo(x0, y0, x1, y1, src.qx[k], src.qy[k]);
+        Homography::inverse(H[i], src.s); //needed to pull back the pixel in I
+        f.src.push_back(src);
+    }
 
     cout << "x0 x1 y0 y1=" << x0 << ' ' << x1 << ' ' << y0 << ' ' << y1<<endl;
 
-    Image<Color> I(int(x1-x0), int(y1-y0));
-    setActiveWindow( openWindow(I.width(), I.height()) );
-    I.fill(WHITE);
-
-    Matrix<float> S; S = inverse(H); //needed to pull back the pixel in the image I1
+    f.ox=int(floor(x0)); f.oy=int(floor(y0));
+    f.w=int(ceil(x1))-f.ox; f.h=int(ceil(y1))-f.oy;
+    return f;
+}
 
-        Vector<float> s(3);
-           for (int i=0; i<I.width(); i++) {
-               for (int j=0;j<I.height(); j++) {
-                  v[0] = x0+i; v[1] = y0+j; v[2] = 1;
-                  s = S*v; s/=s[2];
+// Scratch buffers of composeRow, for rows of up to n pixels
+struct RowScratch {
+    Warp::RowBuffer buf;
+    vector<Color> c; // Colors pulled back from each source, n per source
+    vector<byte> in; // Does the pixel belong to the source?
+    vector<float> w; // Feathering weights, n per source
+    vector<float> wRef; // Feathering weights of the reference
+    RowScratch(const Frame& f, int n)
+    : c(n*f.src.size()), in(n*f.src.size()),
+      w(f.blend==Blend::FEATHER? n*f.src.size(): 0),
+      wRef(f.blend==Blend::FEATHER? n: 0) {}
+};
+
+// Pixels x..x+n-1 of row y of the panorama
+void composeRow(const Frame& f, int x, int y, int n, RowScratch& s,
+                Color* out) {
+    const int m = int(f.src.size());
+    const bool feather = (f.blend == Blend::FEATHER);
+    for(int k=0; k<m; k++)
+        Warp::warpRow(*f.src[k].I, f.src[k].s.data(), f.ox+x, f.oy+y, n,
+                      s.buf, &s.c[k*n], &s.in[k*n], feather? &s.w[k*n]: 0);
+    // Pixels of the row belonging to the reference are [i0,i1)
+    const Image<Color>& R = *f.ref;
+    const int xr=f.ox+x, yr=f.oy+y;
+    const bool rowR = (yr>=0 && yr<R.height());
+    const int i0 = rowR? min(n,max(0,-xr)): n;
+    const int i1 = rowR? max(i0,min(n,R.width()-xr)): n;
+    const Color* cR = rowR? &R(0,yr)+xr: 0;
+    if(m == 1) { // Two images: no search of the images of each pixel
+        const Color* c1 = &s.c[0];
+        const byte* in1 = &s.in[0];
+        for(int i=0; i<i0; i++)
+            out[i] = in1[i]? c1[i]: WHITE;
+        if(! feather) { // Blend all the run, then copy pixels not in I1
+            if(i1 > i0)
+                Blend::geometricMean(cR+i0, c1+i0, i1-i0, out+i0);
+            for(int i=i0; i<i1; i++)
+                if(! in1[i])
+                    out[i] = cR[i];
+        } else {
+            for(int i=i0; i<i1; i++)
+                s.wRef[i] = Blend::borderWeight(float(xr+i), float(yr),
+                                                R.width(), R.height());
+            Blend::feather(cR+i0, &s.wRef[i0], c1+i0, &s.w[i0], i1-i0, out+i0);
+        }
+        for(int i=i1; i<n; i++)
+            out[i] = in1[i]? c1[i]: WHITE;
+        return;
+    }
+    for(int i=0; i<n; i++) {
+        // Colors of the images the pixel belongs to
+        const Color* c[2];
+        int count=0;
+        if(i>=i0 && i<i1)
+            c[count++] = &cR[i];
+        for(int k=0; k<m && count<=2; k++)
+            if(s.in[k*n+i]) {
+                if(count < 2)
+                    c[count] = &s.c[k*n+i];
+                count++;
+            }
+        if(count == 0)
+            out[i] = WHITE;
+        else if(count == 1)
+            out[i] = *c[0];
+        else if(feather) {
+            Blend::Accumulator acc;
+            if(i>=i0 && i<i1)
+                acc.add(cR[i], Blend::borderWeight(float(xr+i), float(yr),
+                                                   R.width(), R.height()));
+            for(int k=0; k<m; k++)
+                if(s.in[k*n+i])
+                    acc.add(s.c[k*n+i], s.w[k*n+i]);
+            out[i] = acc.mean();
+        } else if(count == 2) // we do the mean of the color if it belongs to both images.
+            // geometric mean because it seems to give better results
+            // possible explanation : our eye is sensible to the log of the intensity so a geometric mean might be more convenient
+            out[i] = Blend::geometricMean(*c[0], *c[1]);
+        else { // Three images or more
+            double prod[3]={1,1,1};
+            int q=0;
+            if(i>=i0 && i<i1) {
+                for(int l=0; l<3; l++)
+                    prod[l] *= cR[i][l];
+                q++;
+            }
+            for(int k=0; k<m; k++)
+                if(s.in[k*n+i]) {
+                    for(int l=0; l<3; l++)
+                        prod[l] *= s.c[k*n+i][l];
+                    q++;
+                }
+            for(int l=0; l<3; l++)
+                out[i][l] = byte(pow(prod[l], 1.0/q));
+        }
+    }
+}
 
-                  bool test1 = (s[0]>=0 && s[0]<I1.width() && s[1]>=0 && s[1]<I1.height()); // test if the pixel (pulled back) belongs to I1
-                  bool test2 = (v[0]>=0 && v[0]<I2.width() && v[1]>=0 && v[1]<I2.height()); // test if the pixel belongs to I2
+// Panorama construction
+Image<Color> panorama(const Frame& f) {
+    Image<Color> I(f.w, f.h);
+
+    // Bands of rows in parallel
+    const int band=16;
+    Parallel::parallelFor((f.h+band-1)/band, [&](int b) {
+        RowScratch s(f, f.w);
+        for(int j=b*band; j<min(f.h,(b+1)*band); j++)
+            composeRow(f, 0, j, f.w, s, &I(0,j));
+    });
+    return I;
+}
 
-                  if (test1) I(i,j) = I1(int(s[0]), int(s[1]));
-                  if (test2) I(i,j) = I2(int(v[0]), int(v[1]));
+// Panorama written by tiles to file, see TileStore.h. Only tiles meeting one
+// of the images are computed; memory is one tile per thread. Return the number
+// of pixels computed, -1 on error.
+double panoramaTiles(const Frame& f, const string& fileName, int size) {
+    TileWriter out(fileName, f.w, f.h, size);
+    if(! out.ok())
+        return -1;
+    const int nx=out.tilesX(), ny=out.tilesY();
+    atomic<int> written(0);
+    Parallel::parallelFor(nx*ny, [&](int t) {
+        const int x=(t%nx)*size, y=(t/nx)*size;
+        // Tile in the frame of the reference
+        const float x0=float(f.ox+x), y0=float(f.oy+y);
+        const float x1=x0+size, y1=y0+size;
+        bool in = x1>0 && x0<f.ref->width() && y1>0 && y0<f.ref->height();
+        for(size_t k=0; k<f.src.size() && !in; k++)
+            in = intersects(f.src[k].qx, f.src[k].qy, x0, y0, x1, y1);
+        if(! in)
+            return;
+        RowScratch s(f, size);
+        vector<Color> tile(size*size);
+        for(int j=0; j<size; j++)
+            composeRow(f, x, y+j, size, s, &tile[j*size]);
+        out.write(t%nx, t/nx, &tile[0]);
+        written++;
+    });
+    if(! out.close())
+        return -1;
+    cout << written << '/' << nx*ny << " tiles written" << endl;
+    return double(written)*size*size;
+}
 
-                  if (test1 && test2) { // we do the mean of the color if it belongs to both images.
+// SIFT features of I, positions and descriptors
+void features(const Image<Color>& I, vector<float>& pos, vector<float>& desc) {
+    SIFTDetector D;
+    D.setFirstOctave(-1);
+    Array<SIFTDetector::Feature> feats = D.run(I);
+    desc = SiftMatch::descriptors(feats);
+    pos.resize(2*feats.size());
+    for(size_t i=0; i<feats.size(); i++) {
+        pos[2*i] = feats[i].pos.x();
+        pos[2*i+1] = feats[i].pos.y();
+    }
+}
 
-                      int r1 =  I1(int(s[0]),int(s[1])).r();
-                      int g1 =  I1(int(s[0]),int(s[1])).g();
-                      int b1 =  I1(int(s[0]),int(s[1])).b();
-                      int r2 =  I2(int(v[0]),int(v[1])).r();
-                      int g2 =  I2(int(v[0]),int(v[1])).g();
-                      int b2 =  I2(int(v[0]),int(v[1])).b();
+// Homographies H[k] mapping image k into the reference, the middle image of
+// the sequence I, chained from RANSAC fits between consecutive images.
+// Return the index of the reference, -1 if a pair cannot be registered.
+int registerSequence(const vector<Image<Color> >& I, vector<Mat3>& H,
+                     BenchReport& bench) {
+    const int n = int(I.size());
+    bench.start("sift");
+    vector< vector<float> > pos(n), desc(n);
+    for(int k=0; k<n; k++)
+        features(I[k], pos[k], desc[k]);
+    bench.stop();
+
+    // G[k] maps image k to image k+1
+    bench.start("matching");
+    SiftMatch::Options opt;
+    vector< vector<Homography::Match> > matches(n-1);
+    for(int k=0; k+1<n; k++) {
+        vector<SiftMatch::Pair> pairs =
+            SiftMatch::match(desc[k].data(), int(pos[k].size()/2),
+                             desc[k+1].data(), int(pos[k+1].size()/2), opt);
+        for(size_t p=0; p<pairs.size(); p++) {
+            const int i=pairs[p].i, j=pairs[p].j;
+            Homography::Match mt = {pos[k][2*i], pos[k][2*i+1],
+                                    pos[k+1][2*j], pos[k+1][2*j+1]};
+            matches[k].push_back(mt);
+        }
+    }
+    bench.stop();
+    bench.start("ransac");
+    vector<Mat3> G(n-1);
+    for(int k=0; k+1<n; k++) {
+        vector<int> inliers;
+        const bool ok = Homography::estimate(matches[k], G[k], inliers, k);
+        cout << "Pair " << k << '-' << k+1 << ": " << inliers.size() << '/'
+             << matches[k].size() << " inliers" << endl;
+        if(! ok) {
+            bench.stop();
+            return -1;
+        }
+    }
+    bench.stop();
+
+    // Chain to the reference
+    const int ref = n/2;
+    H.assign(n, Homography::identity());
+    for(int k=ref-1; k>=0; k--)
+        H[k] = Homography::product(H[k+1], G[k]);
+    for(int k=ref+1; k<n; k++) {
+        Mat3 inv;
+        if(! Homography::inverse(G[k-1], inv))
+            return -1;
+        H[k] = Homography::product(H[k-1], inv);
+    }
+    return ref;
+}
 
-                        // geometric mean because it seems to give better results
-                        // possible explanation : our eye is sensible to the log of the intensity so a geometric mean might be more convenient
-                      I(i,j).r() = int(sqrt(r1*r2));
-                      I(i,j).g() = int(sqrt(g1*g2));
-                      I(i,j).b() = int(sqrt(b1*b2));
-                  }
+// Frame of the registered sequence I, H from registerSequence
+Frame sequenceFrame(const vector<Image<Color> >& I, const vector<Mat3>& H,
+                    int ref) {
+    vector<const Image<Color>*> others;
+    vector<Mat3> toRef;
+    for(size_t k=0; k<I.size(); k++)
+        if(int(k) != ref) {
+            others.push_back(&I[k]);
+            toRef.push_back(H[k]);
+        }
+    return frame(I[ref], others, toRef);
+}
 
+// Image files of directory dir (.jpg, .jpeg, .png), sorted by name
+vector<string> imageFiles(const string& dir) {
+    vector<string> files;
+    if(DIR* d = opendir(dir.c_str())) {
+        while(dirent* e = readdir(d)) {
+            string name(e->d_name), ext;
+            const size_t dot = name.rfind('.');
+            if(dot != string::npos)
+                ext = name.substr(dot);
+            transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if(ext==".jpg" || ext==".jpeg" || ext==".png")
+                files.push_back(dir+'/'+name);
+        }
+        closedir(d);
+    }
+    sort(files.begin(), files.end());
+    return files;
+}
 
-               }
-           } // ------------- TODO/A completer ----------
-    display(I,0,0);
+// Subdirectories of dir, sorted by name
+vector<string> subdirectories(const string& dir) {
+    vector<string> names;
+    if(DIR* d = opendir(dir.c_str())) {
+        while(dirent* e = readdir(d)) {
+            const string name(e->d_name);
+            struct stat st;
+            if(name[0] != '.' && stat((dir+'/'+name).c_str(), &st) == 0 &&
+               S_ISDIR(st.st_mode))
+                names.push_back(name);
+        }
+        closedir(d);
+    }
+    sort(names.begin(), names.end());
+    return names;
 }
 
-// Main function
-int main(int argc, char* argv[]) {
-    const char* s1 = argc>1? argv[1]: srcPath("image0006.jpg");
-    const char* s2 = argc>2? argv[2]: srcPath("image0007.jpg");
+// Stitch each image sequence of dir (one per subdirectory) into
+// outDir/name.png, sequences in parallel. Return the number of failures.
+int batch(const string& dir, const string& outDir, Blend::Mode blend,
+          BenchReport& bench) {
+    const vector<string> names = subdirectories(dir);
+    atomic<int> failures(0);
+    atomic<long> pixels(0);
+    bench.start("batch");
+    Parallel::parallelFor(int(names.size()), [&](int s) {
+        const vector<string> files = imageFiles(dir+'/'+names[s]);
+        vector<Image<Color> > I(files.size());
+        bool ok = files.size() >= 2;
+        for(size_t k=0; k<files.size() && ok; k++)
+            ok = load(I[k], files[k]);
+        BenchReport local(names[s]); // Stages of this sequence, not reported
+        vector<Mat3> H;
+        const int ref = ok? registerSequence(I, H, local): -1;
+        if(ref >= 0) {
+            Frame f = sequenceFrame(I, H, ref);
+            f.blend = blend;
+            const Image<Color> P = panorama(f);
+            pixels += long(P.width())*P.height();
+            ok = save(P, outDir+'/'+names[s]+".png");
+        }
+        if(! ok || ref < 0) {
+            cerr << "Failed to stitch " << names[s] << endl;
+            failures++;
+        }
+    });
+    bench.stop();
+    bench.setWork(double(pixels));
+    cout << names.size()-failures << '/' << names.size()
+         << " sequences stitched" << endl;
+    return failures;
+}
 
-    // Load and display images
-    Image<Color> I1, I2;
-    if( ! load(I1, s1) ||
-        ! load(I2, s2) ) {
-        cerr<< "Unable to load the images" << endl;
-        return 1;
-    }
-    Window w1 = openWindow(I1.width(), I1.height(), s1);
+#ifndef HEADLESS
+// Display I1 and I2 in windows of titles s1 and s2. Without point matches
+// pts1, pts2 yet, get them by clicks in the windows.
+void clickPoints(const Image<Color>& I1, const Image<Color>& I2,
+                 const string& s1, const string& s2,
+                 vector<IntPoint2>& pts1, vector<IntPoint2>& pts2) {
+    Window w1 = openWindow(I1.width(), I1.height(), s1.c_str());
     display(I1,0,0);
-    Window w2 = openWindow(I2.width(), I2.height(), s2);
+    Window w2 = openWindow(I2.width(), I2.height(), s2.c_str());
     setActiveWindow(w2);
     display(I2,0,0);
 
     // Get user's clicks in images
-    vector<IntPoint2> pts1, pts2;
-    getClicks(w1, w2, pts1, pts2);
+    if(pts1.empty())
+        getClicks(w1, w2, pts1, pts2);
+}
+#endif
 
+// Homography mapping points pts1 to pts2
+Mat3 pointsHomography(const vector<IntPoint2>& pts1,
+                      const vector<IntPoint2>& pts2) {
     vector<IntPoint2>::const_iterator it;
     cout << "pts1="<<endl;
     for(it=pts1.begin(); it != pts1.end(); it++)
@@ -172,10 +504,143 @@ int main(int argc, char* argv[]) {
     // Compute homography
     Matrix<float> H = getHomography(pts1, pts2);
     cout << "H=" << H/H(2,2);
+    Mat3 h;
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+            h[3*i+j] = H(i,j);
+    return h;
+}
 
-    // Apply homography
-    panorama(I1, I2, H);
+// Main function
+int main(int argc, char* argv[]) {
+    // Options (--name=value) come before positional arguments
+    string pointsFile; // Point matches instead of clicks
+    string outFile;    // Panorama image (directory with --batch)
+    string jsonFile;   // Stage timings
+    int nThreads=0;    // Threads for warping (0: all hardware threads)
+    string tilesFile;  // Panorama by tiles, not held in memory
+    int tileSize=256;
+    bool autoMode=false; // Homographies from SIFT matches, any number of images
+    string batchDir;     // One image sequence per subdirectory, stitched
+    Blend::Mode blend=Blend::MEAN; // Blending of overlaps
+    int a=1;
+    for(; a<argc && string(argv[a]).compare(0,2,"--")==0; a++) {
+        string opt(argv[a]);
+        if(opt.compare(0,9,"--points=")==0)
+            pointsFile = opt.substr(9);
+        else if(opt.compare(0,6,"--out=")==0)
+            outFile = opt.substr(6);
+        else if(opt.compare(0,7,"--json=")==0)
+            jsonFile = opt.substr(7);
+        else if(opt.compare(0,10,"--threads=")==0)
+            nThreads = stoi(opt.substr(10));
+        else if(opt.compare(0,8,"--tiles=")==0)
+            tilesFile = opt.substr(8);
+        else if(opt.compare(0,7,"--tile=")==0) {
+            tileSize = stoi(opt.substr(7));
+            if(tileSize < 1) {
+                cerr << "--tile must be at least 1" << endl;
+                return 1;
+            }
+        } else if(opt == "--auto")
+            autoMode = true;
+        else if(opt.compare(0,8,"--batch=")==0)
+            batchDir = opt.substr(8);
+        else if(opt == "--blend=mean" || opt == "--blend=feather")
+            blend = (opt=="--blend=feather")? Blend::FEATHER: Blend::MEAN;
+        else {
+            cerr << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    Parallel::pool(nThreads);
+    BenchReport bench("Panorama");
+    if(! batchDir.empty()) { // No interaction, no display
+        const int failures = batch(batchDir, outFile.empty()? batchDir: outFile,
+                                   blend, bench);
+        if(! jsonFile.empty() && ! bench.write(jsonFile))
+            cerr << "Error writing " << jsonFile << endl;
+        return failures? 1: 0;
+    }
+#ifdef HEADLESS
+    if(pointsFile.empty() && ! autoMode) {
+        cerr << "Usage: " << argv[0] << " --points=file|--auto|--batch=dir"
+             << " [--out=file] [--json=file] [--threads=n] [--tiles=file]"
+             << " [--tile=size] [--blend=mean|feather] im1 im2 [im3...]"
+             << endl;
+        return 1;
+    }
+#endif
+    vector<string> files(argv+a, argv+argc);
+    if(files.empty()) {
+        files.push_back(srcPath("image0006.jpg"));
+        files.push_back(srcPath("image0007.jpg"));
+    }
+    if(files.size() < 2 || (files.size() > 2 && ! autoMode)) {
+        cerr << "Two images are needed, or more with --auto" << endl;
+        return 1;
+    }
 
+    // Load and display images
+    vector<Image<Color> > images(files.size());
+    for(size_t k=0; k<files.size(); k++)
+        if(! load(images[k], files[k])) {
+            cerr<< "Unable to load the images" << endl;
+            return 1;
+        }
+    Frame f;
+    vector<Mat3> H;
+    if(autoMode) {
+        const int ref = registerSequence(images, H, bench);
+        if(ref < 0) {
+            cerr << "Unable to register the images" << endl;
+            return 1;
+        }
+        f = sequenceFrame(images, H, ref);
+    } else {
+        vector<IntPoint2> pts1, pts2; // Point matches, read or clicked
+        if(! pointsFile.empty() && ! loadPoints(pointsFile, pts1, pts2)) {
+            cerr << "Unable to read point matches in " << pointsFile << endl;
+            return 1;
+        }
+#ifndef HEADLESS
+        clickPoints(images[0], images[1], files[0], files[1], pts1, pts2);
+#endif
+        H.push_back(pointsHomography(pts1, pts2));
+        f = frame(images[1], vector<const Image<Color>*>(1,&images[0]), H);
+    }
+
+    f.blend = blend;
+
+    // Apply homographies
+    bench.start("warp");
+    if(! tilesFile.empty()) { // Out-of-core: no image in memory, no display
+        const double pixels = panoramaTiles(f, tilesFile, tileSize);
+        bench.stop();
+        bench.setWork(pixels);
+        if(pixels < 0) {
+            cerr << "Error writing " << tilesFile << endl;
+            return 1;
+        }
+        if(! jsonFile.empty() && ! bench.write(jsonFile))
+            cerr << "Error writing " << jsonFile << endl;
+#ifndef HEADLESS
+        endGraphics();
+#endif
+        return 0;
+    }
+    Image<Color> I = panorama(f);
+    bench.stop();
+    bench.setWork(double(I.width())*I.height());
+    if(! outFile.empty())
+        save(I, outFile);
+    if(! jsonFile.empty() && ! bench.write(jsonFile))
+        cerr << "Error writing " << jsonFile << endl;
+
+#ifndef HEADLESS
+    setActiveWindow( openWindow(I.width(), I.height()) );
+    display(I,0,0);
     endGraphics();
+#endif
     return 0;
 }
@@ -0,0 +1,143 @@
+// Imagine++ project
+// Minimal thread pool shared by the 3D computer vision programs, and random
+// streams that do not depend on the thread using them.
+// Link with -pthread.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Parallel {
+
+/// Pool of worker threads running indexed tasks. The calling thread takes part
+/// in the work. A task started from inside a task is run serially, so nested
+/// loops are allowed.
+class ThreadPool {
+public:
+    /// n threads in total (0: one per hardware thread)
+    explicit ThreadPool(int n=0);
+    ~ThreadPool();
+    /// Number of threads, including the caller
+    int size() const { return int(workers.size())+1; }
+    /// Call f(i) for all i in [0,n) and return when all calls are done
+    void run(int n, const std::function<void(int)>& f);
+private:
+    void work();
+    void process();
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable wake, done;
+    const std::function<void(int)>* task; ///< Current task
+    int nTasks;
+    std::atomic<int> next;    ///< Next index to process
+    int running;              ///< Workers still processing current task
+    unsigned generation;      ///< Incremented at each new task
+    bool quit;
+    static bool& inside() { static thread_local bool b=false; return b; }
+};
+
+inline ThreadPool::ThreadPool(int n)
+: task(0), nTasks(0), next(0), running(0), generation(0), quit(false) {
+    if(n <= 0)
+        n = std::max(1u, std::thread::hardware_concurrency());
+    for(int i=1; i<n; i++)
+        workers.push_back(std::thread(&ThreadPool::work, this));
+}
+
+inline ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        quit = true;
+    }
+    wake.notify_all();
+    for(size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+inline void ThreadPool::process() {
+    bool& in = inside();
+    in = true;
+    for(int i=next++; i<nTasks; i=next++)
+        (*task)(i);
+    in = false;
+}
+
+inline void ThreadPool::work() {
+    unsigned seen=0;
+    std::unique_lock<std::mutex> lock(m);
+    while(true) {
+        wake.wait(lock, [&]{ return quit || generation!=seen; });
+        if(quit)
+            return;
+        seen = generation;
+        lock.unlock();
+        process();
+        lock.lock();
+        if(--running == 0)
+            done.notify_one();
+    }
+}
+
+inline void ThreadPool::run(int n, const std::function<void(int)>& f) {
+    if(inside() || workers.empty() || n<=1) {
+        for(int i=0; i<n; i++)
+            f(i);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m);
+    task = &f;
+    nTasks = n;
+    next = 0;
+    running = int(workers.size());
+    ++generation;
+    lock.unlock();
+    wake.notify_all();
+    process();
+    lock.lock();
+    done.wait(lock, [&]{ return running==0; });
+    task = 0;
+}
+
+/// Shared pool, created with n threads at first call (0: hardware threads)
+inline ThreadPool& pool(int n=0) {
+    static ThreadPool p(n);
+    return p;
+}
+
+/// Call f(i) for all i in [0,n) on the shared pool.
+inline void parallelFor(int n, const std::function<void(int)>& f) {
+    pool().run(n, f);
+}
+
+/// Counter-based random generator: the n-th number of a stream is a hash
+/// (SplitMix64 finalizer) of seed, stream and n, so that each stream gives the
+/// same numbers whatever the thread drawing them.
+class CounterRNG {
+public:
+    CounterRNG(uint64_t seed, uint64_t stream)
+    : key(mix(mix(seed)+stream)), counter(0) {}
+    /// Uniform integer in [0,n)
+    int operator()(int n) {
+        return int(((mix(key+counter++)>>32)*uint64_t(n)) >> 32);
+    }
+private:
+    static uint64_t mix(uint64_t z) {
+        z += 0x9E3779B97F4A7C15ull;
+        z = (z^(z>>30))*0xBF58476D1CE4E5B9ull;
+        z = (z^(z>>27))*0x94D049BB133111EBull;
+        return z^(z>>31);
+    }
+    uint64_t key, counter;
+};
+
+} // namespace Parallel
+
+#endif
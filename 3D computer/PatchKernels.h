@@ -0,0 +1,134 @@
+// Imagine++ project
+// Project:  Seeds
+// Patch correlation kernel on byte images: sum of products of pixel values
+// over a pair of patches, an exact integer. SSE4.1 and AVX2 versions are
+// selected at runtime according to the CPU, with a scalar fallback.
+
+#ifndef PATCHKERNELS_H
+#define PATCHKERNELS_H
+
+#include <Imagine/Images.h>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PATCH_KERNELS_X86
+#endif
+
+namespace PatchKernels {
+
+using Imagine::byte;
+
+/// A w x h patch of a byte image: first pixel, row stride and end of image
+/// buffer (vector loads never read past it).
+struct Patch {
+    Patch(const Imagine::Image<byte>& I, int x, int y)
+    : p(&I(x,y)), stride(I.width()), end(I.data()+I.width()*I.height()) {}
+    const byte* p;
+    int stride;
+    const byte* end;
+};
+
+typedef int (*DotKernel)(const Patch&, const Patch&, int w, int h);
+
+inline int dotScalar(const Patch& a, const Patch& b, int w, int h) {
+    int c=0;
+    for(int y=0; y<h; y++) {
+        const byte *p1=a.p+y*a.stride, *p2=b.p+y*b.stride;
+        for(int x=0; x<w; x++)
+            c += int(p1[x])*int(p2[x]);
+    }
+    return c;
+}
+
+#ifdef PATCH_KERNELS_X86
+/// 16 bytes from p, with bytes n and beyond zeroed. Reads past the image
+/// buffer are replaced by a copy.
+__attribute__((target("sse4.1")))
+inline __m128i load16(const byte* p, int n, const byte* end) {
+    static const byte ones[32] = {
+        255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+        0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+    __m128i v;
+    if(p+16 <= end)
+        v = _mm_loadu_si128((const __m128i*)p);
+    else {
+        byte buf[16] = {0};
+        memcpy(buf, p, n);
+        v = _mm_loadu_si128((const __m128i*)buf);
+    }
+    if(n >= 16)
+        return v;
+    return _mm_and_si128(v, _mm_loadu_si128((const __m128i*)(ones+16-n)));
+}
+
+__attribute__((target("sse4.1")))
+inline int hsum(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse4.1")))
+inline int dotSSE(const Patch& a, const Patch& b, int w, int h) {
+    __m128i acc = _mm_setzero_si128();
+    for(int y=0; y<h; y++) {
+        const byte *p1=a.p+y*a.stride, *p2=b.p+y*b.stride;
+        for(int x=0; x<w; x+=16) {
+            __m128i v1 = load16(p1+x, w-x, a.end);
+            __m128i v2 = load16(p2+x, w-x, b.end);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_cvtepu8_epi16(v1),
+                                                    _mm_cvtepu8_epi16(v2)));
+            if(w-x > 8) {
+                v1 = _mm_srli_si128(v1, 8);
+                v2 = _mm_srli_si128(v2, 8);
+                acc = _mm_add_epi32(acc,
+                                    _mm_madd_epi16(_mm_cvtepu8_epi16(v1),
+                                                   _mm_cvtepu8_epi16(v2)));
+            }
+        }
+    }
+    return hsum(acc);
+}
+
+__attribute__((target("avx2")))
+inline int hsum(__m256i v) {
+    return hsum(_mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v,1)));
+}
+
+__attribute__((target("avx2")))
+inline int dotAVX2(const Patch& a, const Patch& b, int w, int h) {
+    __m256i acc = _mm256_setzero_si256();
+    for(int y=0; y<h; y++) {
+        const byte *p1=a.p+y*a.stride, *p2=b.p+y*b.stride;
+        for(int x=0; x<w; x+=16) {
+            __m256i v1 = _mm256_cvtepu8_epi16(load16(p1+x, w-x, a.end));
+            __m256i v2 = _mm256_cvtepu8_epi16(load16(p2+x, w-x, b.end));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(v1,v2));
+        }
+    }
+    return hsum(acc);
+}
+#endif
+
+/// Best dot product kernel for this CPU
+inline DotKernel dotKernel() {
+#ifdef PATCH_KERNELS_X86
+    if(__builtin_cpu_supports("avx2"))
+        return dotAVX2;
+    if(__builtin_cpu_supports("sse4.1"))
+        return dotSSE;
+#endif
+    return dotScalar;
+}
+
+/// Sum of products of pixel values over w x h patches a and b.
+inline int dot(const Patch& a, const Patch& b, int w, int h) {
+    static const DotKernel k = dotKernel();
+    return k(a, b, w, h);
+}
+
+} // namespace PatchKernels
+
+#endif
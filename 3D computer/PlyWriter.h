@@ -0,0 +1,117 @@
+// Imagine++ project
+// Binary PLY file of colored vertices and triangles, streamed to disk. The
+// numbers of vertices and faces are given first, so that the file has a fixed
+// size and every record a known offset: blocks of records are encoded in small
+// buffers and written from any thread, in any order, with POSIX pwrite. No
+// array of the whole geometry is kept in memory. Records (machine byte order,
+// declared in the header):
+//   vertex  float x, y, z; uchar red, green, blue      (15 bytes)
+//   face    uchar 3; int vertex_indices[3]             (13 bytes)
+
+#ifndef PLYWRITER_H
+#define PLYWRITER_H
+
+#include <Imagine/Images.h>
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class PlyWriter {
+public:
+    enum { VERTEX_BYTES=15, FACE_BYTES=13 };
+    /// Create file for nVertices vertices and nFaces triangles.
+    PlyWriter(const std::string& fileName, int64_t nVertices, int64_t nFaces);
+    ~PlyWriter() { close(); }
+    bool ok() const { return fd >= 0 && !failed; }
+    /// Encode vertex (x,y,z) of color c at p; return the end of the record.
+    static char* vertex(char* p, float x, float y, float z,
+                        const Imagine::Color& c);
+    /// Encode triangle (i,j,k) at p; return the end of the record.
+    static char* face(char* p, int i, int j, int k);
+    /// Write n vertices encoded in buf, from index first. Thread-safe.
+    void writeVertices(int64_t first, const char* buf, int64_t n) {
+        write(header+VERTEX_BYTES*uint64_t(first), buf, VERTEX_BYTES*uint64_t(n));
+    }
+    /// Write n faces encoded in buf, from index first. Thread-safe.
+    void writeFaces(int64_t first, const char* buf, int64_t n) {
+        write(header+VERTEX_BYTES*uint64_t(nv)+FACE_BYTES*uint64_t(first), buf,
+              FACE_BYTES*uint64_t(n));
+    }
+    /// Close the file. Return false on error.
+    bool close();
+private:
+    void write(uint64_t offset, const char* buf, uint64_t bytes);
+    int fd;
+    int64_t nv, nf;
+    uint64_t header; ///< Size of header
+    std::atomic<bool> failed;
+};
+
+inline PlyWriter::PlyWriter(const std::string& fileName,
+                            int64_t nVertices, int64_t nFaces)
+: nv(nVertices), nf(nFaces), header(0), failed(false) {
+    fd = open(fileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0)
+        return;
+    std::ostringstream s;
+    s << "ply\nformat "
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+      << "binary_big_endian"
+#else
+      << "binary_little_endian"
+#endif
+      << " 1.0\n"
+      << "element vertex " << nv << '\n'
+      << "property float x\nproperty float y\nproperty float z\n"
+      << "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+      << "element face " << nf << '\n'
+      << "property list uchar int vertex_indices\n"
+      << "end_header\n";
+    const std::string h = s.str();
+    header = h.size();
+    write(0, h.data(), header);
+    // Reserve the whole file, so that blocks can be written in any order
+    if(ftruncate(fd, off_t(header+VERTEX_BYTES*uint64_t(nv)+
+                           FACE_BYTES*uint64_t(nf))) != 0)
+        failed = true;
+}
+
+inline char* PlyWriter::vertex(char* p, float x, float y, float z,
+                               const Imagine::Color& c) {
+    const float v[3] = {x, y, z};
+    memcpy(p, v, sizeof(v));
+    p[12]=char(c[0]); p[13]=char(c[1]); p[14]=char(c[2]);
+    return p+VERTEX_BYTES;
+}
+
+inline char* PlyWriter::face(char* p, int i, int j, int k) {
+    const int32_t v[3] = {i, j, k};
+    p[0] = 3;
+    memcpy(p+1, v, sizeof(v));
+    return p+FACE_BYTES;
+}
+
+inline void PlyWriter::write(uint64_t offset, const char* buf, uint64_t bytes) {
+    for(uint64_t done=0; done<bytes; ) {
+        const ssize_t n = pwrite(fd, buf+done, bytes-done, off_t(offset+done));
+        if(n <= 0) {
+            failed = true;
+            return;
+        }
+        done += n;
+    }
+}
+
+inline bool PlyWriter::close() {
+    if(fd < 0)
+        return false;
+    const bool good = (::close(fd) == 0) && ok();
+    fd = -1;
+    return good;
+}
+
+#endif
@@ -0,0 +1,171 @@
+// Imagine++ project
+// Project:  GraphCutsDisparity
+// Adaptive triangulation of a disparity map. A quadtree over the grid is
+// subdivided until the disparities of each leaf fit a plane (least squares)
+// within a tolerance. A leaf of size 1 is cut in two triangles, a larger one
+// in a fan around its center through all leaf corners on its border, so that
+// neighbor leaves of different sizes share their edges: no crack. Triangles
+// whose vertices differ by more than a jump of disparity are dropped, so that
+// the mesh is torn at discontinuities instead of joining foreground and
+// background.
+
+#ifndef QUADMESH_H
+#define QUADMESH_H
+
+#include <Imagine/Images.h>
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace QuadMesh {
+
+/// Triangle mesh on a grid
+struct Mesh {
+    std::vector<int> vertex; ///< Grid pixel i+nx*j of each vertex
+    std::vector<int> face;   ///< Three vertex numbers per triangle
+};
+
+/// Regular mesh of an nx x ny grid: all pixels, two triangles per cell
+inline Mesh regular(int nx, int ny) {
+    Mesh m;
+    m.vertex.resize(size_t(nx)*ny);
+    for(size_t p=0; p<m.vertex.size(); p++)
+        m.vertex[p] = int(p);
+    m.face.reserve(6*size_t(std::max(0,nx-1))*std::max(0,ny-1));
+    for(int j=0; j+1<ny; j++)
+        for(int i=0; i+1<nx; i++) {
+            const int t[6] = {i+nx*j,   i+1+nx*j,     i+nx*(j+1),
+                              i+1+nx*j, i+1+nx*(j+1), i+nx*(j+1)};
+            m.face.insert(m.face.end(), t, t+6);
+        }
+    return m;
+}
+
+/// Leaf of the quadtree: square [x,x+s]x[y,y+s] of grid pixels
+struct Leaf {
+    int x, y, s;
+};
+
+/// Size of the quadtree roots, which are processed in parallel
+const int ROOT=64;
+
+/// Do the disparities of square [x,x+s]x[y,y+s] fit a plane within tolerance?
+inline bool planar(const Imagine::Image<double>& D, int x, int y, int s,
+                   double tolerance) {
+    // Centered coordinates, so that the normal equations are diagonal
+    const double c = 0.5*s;
+    double sum=0, sumX=0, sumY=0, var=0;
+    for(int j=0; j<=s; j++)
+        for(int i=0; i<=s; i++) {
+            const double d = D(x+i,y+j);
+            sum += d;
+            sumX += d*(i-c);
+            sumY += d*(j-c);
+            var += (i-c)*(i-c);
+        }
+    const double n = double(s+1)*(s+1);
+    const double a = sum/n, b = sumX/var, e = sumY/var;
+    for(int j=0; j<=s; j++)
+        for(int i=0; i<=s; i++)
+            if(std::fabs(D(x+i,y+j) - (a + b*(i-c) + e*(j-c))) > tolerance)
+                return false;
+    return true;
+}
+
+/// Leaves of the quadtree of root [x,x+s]x[y,y+s] (s a power of 2) inside the
+/// grid of D
+inline void subdivide(const Imagine::Image<double>& D, int x, int y, int s,
+                      double tolerance, std::vector<Leaf>& leaves) {
+    const int nx=D.width(), ny=D.height();
+    if(x>=nx-1 || y>=ny-1)
+        return;
+    const bool inside = (x+s<nx && y+s<ny);
+    if(s==1 || (inside && planar(D, x, y, s, tolerance))) {
+        Leaf l = {x, y, s};
+        leaves.push_back(l);
+        return;
+    }
+    const int h = s/2;
+    subdivide(D, x,   y,   h, tolerance, leaves);
+    subdivide(D, x+h, y,   h, tolerance, leaves);
+    subdivide(D, x,   y+h, h, tolerance, leaves);
+    subdivide(D, x+h, y+h, h, tolerance, leaves);
+}
+
+/// Add triangle of grid pixels p, q, r (vertex numbers in index) to face
+/// unless it spans a disparity jump
+inline void triangle(const Imagine::Image<double>& D,
+                     const std::vector<int>& index, int p, int q, int r,
+                     double jump, std::vector<int>& face) {
+    const double* d = D.data();
+    const double lo = std::min(std::min(d[p],d[q]),d[r]);
+    const double hi = std::max(std::max(d[p],d[q]),d[r]);
+    if(hi-lo > jump)
+        return;
+    face.push_back(index[p]);
+    face.push_back(index[q]);
+    face.push_back(index[r]);
+}
+
+/// Adaptive mesh of disparity map D: leaves fit a plane within tolerance,
+/// triangles spanning more than jump are dropped.
+inline Mesh build(const Imagine::Image<double>& D, double tolerance, double jump) {
+    Mesh m;
+    const int nx=D.width(), ny=D.height();
+    if(nx<2 || ny<2)
+        return m;
+    const int rx=(nx-2)/ROOT+1, ry=(ny-2)/ROOT+1; // Roots covering nx-1 cells
+    std::vector< std::vector<Leaf> > leaves(rx*ry);
+    Parallel::parallelFor(rx*ry, [&](int r) {
+        subdivide(D, ROOT*(r%rx), ROOT*(r/rx), ROOT, tolerance, leaves[r]);
+    });
+    // Vertices are leaf corners and centers, numbered in grid order
+    std::vector<int> index(size_t(nx)*ny, -1);
+    for(size_t r=0; r<leaves.size(); r++)
+        for(size_t k=0; k<leaves[r].size(); k++) {
+            const Leaf& l = leaves[r][k];
+            const int p = l.x+nx*l.y, s=l.s;
+            index[p] = index[p+s] = index[p+nx*s] = index[p+s+nx*s] = 0;
+            if(s > 1)
+                index[p+s/2+nx*(s/2)] = 0;
+        }
+    for(size_t p=0; p<index.size(); p++)
+        if(index[p] == 0) {
+            index[p] = int(m.vertex.size());
+            m.vertex.push_back(int(p));
+        }
+    // Faces, same orientation as the regular mesh
+    std::vector< std::vector<int> > faces(rx*ry);
+    Parallel::parallelFor(rx*ry, [&](int r) {
+        std::vector<int> border;
+        for(size_t k=0; k<leaves[r].size(); k++) {
+            const Leaf& l = leaves[r][k];
+            const int p = l.x+nx*l.y, s=l.s;
+            if(s == 1) {
+                triangle(D, index, p,   p+1,    p+nx, jump, faces[r]);
+                triangle(D, index, p+1, p+1+nx, p+nx, jump, faces[r]);
+                continue;
+            }
+            border.clear(); // Clockwise on screen from top-left corner
+            for(int t=0; t<s; t++) border.push_back(p+t);
+            for(int t=0; t<s; t++) border.push_back(p+s+nx*t);
+            for(int t=0; t<s; t++) border.push_back(p+s-t+nx*s);
+            for(int t=0; t<s; t++) border.push_back(p+nx*(s-t));
+            border.erase(std::remove_if(border.begin(), border.end(),
+                                        [&](int q) { return index[q] < 0; }),
+                         border.end());
+            const int c = p+s/2+nx*(s/2);
+            for(size_t t=0; t<border.size(); t++)
+                triangle(D, index, border[t], border[(t+1)%border.size()], c,
+                         jump, faces[r]);
+        }
+    });
+    for(size_t r=0; r<faces.size(); r++)
+        m.face.insert(m.face.end(), faces[r].begin(), faces[r].end());
+    return m;
+}
+
+} // namespace QuadMesh
+
+#endif
@@ -4,10 +4,20 @@
 // Student: Marceau PAILHAS
 
 #include <Imagine/Images.h>
+#include "PatchKernels.h"
+#include "Parallel.h"
+#include "Bench.h"
+#include "PlyWriter.h"
 #include <queue>
 #include <string>
 #include <iostream>
 #include <typeinfo>
+#include <vector>
+#include <climits>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
 using namespace Imagine;
 using namespace std;
 
@@ -23,6 +33,31 @@ static const int win=(9-1)/2;
 /// To avoid division by 0 for constant patch
 static const float EPS=0.1f;
 
+/// Memory cap of the cost volume in MB (0: no volume, NCC computed on demand)
+static int volumeMB=0;
+
+/// Number of threads (0: one per hardware thread)
+static int nThreads=0;
+/// Rows per band of the parallel seed search
+static const int bandHeight=16;
+/// Pyramid levels above full resolution for coarse-to-fine search (0: none)
+static int pyramidLevels=0;
+/// Search radius around upsampled disparity in coarse-to-fine search
+static int pyramidRadius=2;
+/// Size of tiles for parallel propagation (0: single queue)
+static int tileSize=0;
+/// Tolerance on best-first order of parallel propagation
+static float nccTolerance=0.05f;
+/// Print statistics
+static bool verbose=false;
+/// Directory of output images (empty: source directory)
+static string outDir;
+
+/// Path of output file
+static string outPath(const string& name) {
+    return outDir.empty()? string(srcPath(name.c_str())): outDir+"/"+name;
+}
+
 /// A seed
 struct Seed {
     Seed(int x0, int y0, int d0, float ncc0)
@@ -40,8 +75,8 @@ bool operator<(const Seed& s1, const Seed& s2) {
 static const int dx[]={+1,  0, -1,  0};
 static const int dy[]={ 0, -1,  0, +1};
 
-/// Display disparity map
-static Image<Color> displayDisp(const Image<int>& disp, Window W, int subW) {
+/// Image of disparity map, cyan where invalid
+static Image<Color> dispImage(const Image<int>& disp) {
     Image<Color> im(disp.width(), disp.height());
     for(int j=0; j<disp.height(); j++)
         for(int i=0; i<disp.width(); i++) {
@@ -52,34 +87,96 @@ static Image<Color> displayDisp(const Image<int>& disp, Window W, int subW) {
                 im(i,j)= Color(g,g,g); //balck if totally disparate, white otherwise
             }
         }
+    return im;
+}
+
+/// Display disparity map in subwindow subW of W. Return its image.
+#ifndef HEADLESS
+static Image<Color> displayDisp(const Image<int>& disp, Window W, int subW) {
+    Image<Color> im = dispImage(disp);
     setActiveWindow(W,subW);
     display(im);
     showWindow(W,subW);
     return im;
 }
+#else
+static Image<Color> displayDisp(const Image<int>& disp, Window, int) {
+    return dispImage(disp);
+}
+#endif
 
-/// Show 3D window
-static void show3D(const Image<Color>& im, const Image<int>& disp) {
-#ifdef IMAGINE_OPENGL // Imagine++ must have been built with OpenGL support...
-    // Intrinsic parameters given by Middlebury website
-    const float f=3740;
-    const float d0=-200; // Doll images cropped by this amount
-    const float zoom=2; // Half-size images, should double measured disparity
-    const float B=0.160; // Baseline in m
-    FMatrix<float,3,3> K(0.0f);
-    K(0,0)=-f/zoom; K(0,2)=disp.width()/2;
-    K(1,1)= f/zoom; K(1,2)=disp.height()/2;
+/// Back-projection of pixels to 3D, with intrinsic parameters given by
+/// Middlebury website
+struct Camera {
+    Camera(int w, int h);
+    /// 3D point of pixel (i,j) of disparity d
+    FloatPoint3 point(int i, int j, int d) const {
+        float z = B*f/(zoom*d+d0);
+        FloatPoint3 pt((float)i,(float)j,1.0f);
+        return K*pt*z;
+    }
+    static const float f, d0, zoom, B;
+    FMatrix<float,3,3> K; ///< Inverse of intrinsic parameters
+};
+const float Camera::f=3740;
+const float Camera::d0=-200; // Doll images cropped by this amount
+const float Camera::zoom=2; // Half-size images, should double measured disparity
+const float Camera::B=0.160; // Baseline in m
+
+Camera::Camera(int w, int h): K(0.0f) {
+    K(0,0)=-f/zoom; K(0,2)=w/2;
+    K(1,1)= f/zoom; K(1,2)=h/2;
     K(2,2)=1.0f;
     K = inverse(K);
     K /= K(2,2);
+}
+
+/// Write the 3D points of valid disparities, colored by im, to binary PLY
+/// file. Points of each band of rows are counted, then back-projected and
+/// written at their offset, bands in parallel. Return false on error.
+static bool writePLY(const string& fileName,
+                     const Image<Color>& im, const Image<int>& disp) {
+    const int w=disp.width(), h=disp.height();
+    const int bands = (h+bandHeight-1)/bandHeight;
+    std::vector<int64_t> first(bands+1, 0); // First point of each band
+    Parallel::parallelFor(bands, [&](int b) {
+        int n=0;
+        for(int j=b*bandHeight; j<std::min(h,(b+1)*bandHeight); j++)
+            for(int i=0; i<w; i++)
+                n += (dmin<=disp(i,j) && disp(i,j)<=dmax);
+        first[b+1] = n;
+    });
+    for(int b=0; b<bands; b++)
+        first[b+1] += first[b];
+    const Camera cam(w, h);
+    PlyWriter ply(fileName, first[bands], 0);
+    if(! ply.ok())
+        return false;
+    Parallel::parallelFor(bands, [&](int b) {
+        std::vector<char> buf(size_t(first[b+1]-first[b])*PlyWriter::VERTEX_BYTES);
+        char* p = buf.data();
+        for(int j=b*bandHeight; j<std::min(h,(b+1)*bandHeight); j++)
+            for(int i=0; i<w; i++)
+                if(dmin<=disp(i,j) && disp(i,j)<=dmax) {
+                    const FloatPoint3 q = cam.point(i, j, disp(i,j));
+                    p = PlyWriter::vertex(p, q.x(), q.y(), q.z(), im(i,j));
+                }
+        ply.writeVertices(first[b], buf.data(), first[b+1]-first[b]);
+    });
+    return ply.close();
+}
+
+#ifndef HEADLESS
+/// Show 3D window
+#ifdef IMAGINE_OPENGL // Imagine++ must have been built with OpenGL support...
+static void show3D(const Image<Color>& im, const Image<int>& disp) {
+    const Camera cam(disp.width(), disp.height());
     std::vector<FloatPoint3> pts;
     std::vector<Color> col;
     for(int j=0; j<disp.height(); j++)
         for(int i=0; i<disp.width(); i++)
             if(dmin<=disp(i,j) && disp(i,j)<=dmax) {
-                float z = B*f/(zoom*disp(i,j)+d0);
-                FloatPoint3 pt((float)i,(float)j,1.0f);
-                pts.push_back(K*pt*z);
+                pts.push_back(cam.point(i, j, disp(i,j)));
                 col.push_back(im(i,j));
             }
     Mesh mesh(&pts[0], pts.size(), 0,0,0,0,VERTEX_COLOR);
@@ -87,145 +184,703 @@ static void show3D(const Image<Color>& im, const Image<int>& disp) {
     Window W = openWindow3D(512,512,"3D");
     setActiveWindow(W);
     showMesh(mesh);
+}
 #else
+static void show3D(const Image<Color>&, const Image<int>&) {
     std::cout << "No 3D: Imagine++ not built with OpenGL support" << std::endl;
+}
+#endif
 #endif
+
+/// Sum of products of pixel values over patches centered on (i1,j1) and
+/// (i2,j2). This cross term is the only part of NCC depending on disparity.
+static int correl(const Image<byte>& im1, int i1,int j1,
+                  const Image<byte>& im2, int i2,int j2) {
+    return PatchKernels::dot(PatchKernels::Patch(im1,i1-win,j1-win),
+                             PatchKernels::Patch(im2,i2-win,j2-win),
+                             2*win+1, 2*win+1);
 }
 
-/// Correlation between patches centered on (i1,j1) and (i2,j2). The values
-/// m1 or m2 are subtracted from each pixel value.
-static float correl(const Image<byte>& im1, int i1,int j1,float m1,
-                    const Image<byte>& im2, int i2,int j2,float m2) {
-    float dist=0.0f;
-    float std1, std2;
-    // We will look for the value of d that maximizes NCC
-    //for(int di= -i2+win;di < im2.width()-i2 +win;di++){
-        //for (int dj=-j2+win;dj < im2.height()-j2 +win;dj++){
-
-            //float d0 =0;
-            // for each patch we compute the sum of (I(p+r)-m1)*(I'(p+r+d)-m2) over all r in the patch
-            for(int x=-win; x< win+1;x++){
-                for (int y=-win; y <win+1; y++){
-                    std1 = std1 + pow(float(im1(i1+x,j1+y))-m1,2) ;
-                    std2 = std2 + pow(float(im2(i2+x,j2+y))-m2,2);
-                    dist = dist +(float(im1(i1+x,j1+y))-m1)*(float(im2(i2+x,j2+y))-m2);};};
-                    dist = dist/(sqrt(std1*std2)) ;
-                    //if(d0>dist){dist=d0; cout <<"we change dist"<<endl;}
-        //cout<<"we get dist="<<dist<<" while std1= "<<std1<<endl;
-        //}
-         //}
-    // ------------- TODO -------------
-    return dist;
+/// Summed-area table of pixel values (or of their squares) of an image.
+/// Entry (i,j) is the sum over [0,i)x[0,j). Unsigned arithmetic may wrap
+/// around on large images, but the difference of four entries is still exact
+/// since a patch sum always fits in 32 bits.
+/// S is reallocated only if its size does not fit.
+static void integral(const Image<byte>& im, bool squares,
+                     Image<unsigned int>& S) {
+    if(S.width()!=im.width()+1 || S.height()!=im.height()+1)
+        S = Image<unsigned int>(im.width()+1, im.height()+1);
+    for(int i=0; i<S.width(); i++)
+        S(i,0) = 0;
+    for(int j=0; j<im.height(); j++) {
+        unsigned int row=0;
+        S(0,j+1) = 0;
+        for(int i=0; i<im.width(); i++) {
+            unsigned int v = im(i,j);
+            row += squares? v*v: v;
+            S(i+1,j+1) = S(i+1,j) + row;
+        }
+    }
 }
 
-/// Sum of pixel values in patch centered on (i,j).
-static float sum(const Image<byte>& im, int i, int j) {
-    float s=0.0f;
-    // We go through the whole patch.
-    for(int x=-win; x< win+1;x++){
-        for (int y=-win; y <win+1; y++){
-            //cout<<"  im(i+x,j+y)"<<int(im(i+x,j+y))<<endl;
+/// Sum over patch centered on (i,j) from summed-area table S.
+static unsigned int sum(const Image<unsigned int>& S, int i, int j) {
+    return S(i+win+1,j+win+1) - S(i-win,j+win+1)
+         - S(i+win+1,j-win)   + S(i-win,j-win);
+}
 
-            s=s+float(im(i+x,j+y));
-        };}
+/// NCC engine. Patch sums and sums of squares of both images are read in O(1)
+/// from summed-area tables built once, so that only the cross term remains to
+/// compute for each disparity.
+class NccEngine {
+public:
+    NccEngine(const Image<byte>& im1, const Image<byte>& im2) {
+        reset(im1, im2);
+    }
+    /// New pair of images, reusing the summed-area tables if the size is the
+    /// same.
+    void reset(const Image<byte>& im1, const Image<byte>& im2) {
+        I1 = im1; I2 = im2;
+        integral(I1,false,S1); integral(I1,true,Q1);
+        integral(I2,false,S2); integral(I2,true,Q2);
+    }
+    const Image<byte>& image1() const { return I1; }
+    const Image<byte>& image2() const { return I2; }
+    /// Centered correlation of patches of size 2*win+1.
+    float ccorrel(int i1,int j1, int i2,int j2) const;
+private:
+    Image<byte> I1, I2;
+    Image<unsigned int> S1, Q1, S2, Q2; ///< Sums and sums of squares
+};
+
+float NccEngine::ccorrel(int i1,int j1, int i2,int j2) const {
+    const double n = (2*win+1)*(2*win+1);
+    const double s1=sum(S1,i1,j1), s2=sum(S2,i2,j2);
+    const double var1 = sum(Q1,i1,j1) - s1*s1/n;
+    const double var2 = sum(Q2,i2,j2) - s2*s2/n;
+    const double cov = correl(I1,i1,j1, I2,i2,j2) - s1*s2/n;
+    return float(cov / sqrt((var1+EPS)*(var2+EPS)));
+}
+
+/// Disparity-space cost volume: NCC of each (x,y,d) with d in [dmin,dmax] is
+/// computed at most once, stored quantized on 16 bits and served to all
+/// passes. If the volume does not fit in maxMB, NCC is computed on demand.
+class CostVolume {
+public:
+    CostVolume(const NccEngine& E, int maxMB);
+    const NccEngine& engine() const { return E; }
+    bool stored() const { return !V.empty(); }
+    /// Forget stored NCC, after a reset of the engine to images of same size.
+    void clear() { std::fill(V.begin(), V.end(), short(UNKNOWN)); }
+    /// NCC between (x,y) in image 1 and (x+d,y) in image 2.
+    float ccorrel(int x, int y, int d);
+private:
+    enum { UNKNOWN=SHRT_MIN, ///< Not computed yet
+           SCALE=SHRT_MAX }; ///< Quantization of [-1,1]
+    const NccEngine& E;
+    int w, nd;
+    std::vector<short> V; ///< Index ((x+w*y)*nd+d-dmin)
+};
+
+CostVolume::CostVolume(const NccEngine& E0, int maxMB)
+: E(E0), w(E0.image1().width()), nd(dmax-dmin+1) {
+    const int h = std::min(E.image1().height(),E.image2().height());
+    const double bytes = double(w)*h*nd*sizeof(short);
+    if(0<maxMB && bytes <= maxMB*1048576.0)
+        V.assign(size_t(w)*h*nd, short(UNKNOWN));
+    else if(0<maxMB)
+        std::cout << "Cost volume needs " << int(bytes/1048576) << "MB > "
+                  << maxMB << "MB: computing NCC on demand" << std::endl;
+}
+
+float CostVolume::ccorrel(int x, int y, int d) {
+    if(V.empty() || d<dmin || d>dmax)
+        return E.ccorrel(x,y, x+d,y);
+    short& q = V[(x+size_t(w)*y)*nd+d-dmin];
+    if(q == UNKNOWN) {
+        float ncc = std::max(-1.0f, std::min(1.0f, E.ccorrel(x,y, x+d,y)));
+        q = short(floor(ncc*SCALE+0.5f));
+    }
+    return q/float(SCALE);
+}
 
-    // ------------- TODO -------------
-    return s;
+/// Disparity in [d0,d1] maximizing NCC at pixel (x,y), for a scorer C giving
+/// C.ccorrel(x,y,d). Windows not fully in image 2 (of width w2) are ignored.
+/// Return the best NCC, or 0 leaving d unchanged if no NCC is positive.
+template <class Scorer>
+static float best_disparity(Scorer& C, int w2, int x, int y, int d0, int d1,
+                            int& d) {
+    float ncc=0.0f;
+    for(int di=d0; di<=d1; di++)
+        if(x+di >= win && x+di < -win+w2) {
+            float cor = C.ccorrel(x,y, di);
+            if(cor>ncc) {
+                ncc = cor;
+                d = di;
+            }
+        }
+    return ncc;
 }
 
-/// Centered correlation of patches of size 2*win+1.
-static float ccorrel(const Image<byte>& im1,int i1,int j1,
-                     const Image<byte>& im2,int i2,int j2) {
-    float m1 = sum(im1,i1,j1);
-    float m2 = sum(im2,i2,j2);
-    int w = 2*win+1;
-    return correl(im1,i1,j1,m1/(w*w), im2,i2,j2,m2/(w*w));
+/// Best disparity at all pixels of im1 whose window is fully in image, in
+/// [d0,d1] given by range(x,y,d0,d1). Bands of rows are processed in
+/// parallel. disp and ncc are left unchanged where no NCC is positive.
+template <class Scorer, class Range>
+static void search_disparity(Scorer& C,
+                             const Image<byte>& im1, const Image<byte>& im2,
+                             const Range& range,
+                             Image<int>& disp, Image<float>& ncc,
+                             bool progress) {
+    const int maxy = std::min(im1.height(),im2.height());
+    const int rows = std::max(0, maxy-2*win);
+    const int nBands = (rows+bandHeight-1)/bandHeight;
+    std::atomic<int> bandsDone(0);
+    std::mutex coutMutex;
+    Parallel::parallelFor(nBands, [&](int b) {
+        const int y1 = win+std::min(rows,(b+1)*bandHeight);
+        for(int y=win+b*bandHeight; y<y1; y++)
+            for(int x=win; x+win<im1.width(); x++) {
+                int d0, d1;
+                range(x,y, d0,d1);
+                float n = best_disparity(C, im2.width(), x,y, d0,d1, disp(x,y));
+                if(n > 0)
+                    ncc(x,y) = n;
+            }
+        const int done = ++bandsDone;
+        if(progress && 20*done/nBands != 20*(done-1)/nBands) {
+            std::lock_guard<std::mutex> lock(coutMutex);
+            std::cout << "Seeds: " << 100*done/nBands << "%\r" << std::flush;
+        }
+    });
+    if(progress)
+        std::cout << std::endl;
+}
+
+/// NCC on a pyramid level, where no cost volume is kept
+struct LevelScorer {
+    explicit LevelScorer(const NccEngine& E0): E(E0) {}
+    float ccorrel(int x, int y, int d) const { return E.ccorrel(x,y, x+d,y); }
+    const NccEngine& E;
+};
+
+/// Image of half size, average of 2x2 blocks
+static Image<byte> half_size(const Image<byte>& im) {
+    Image<byte> h(im.width()/2, im.height()/2);
+    for(int j=0; j<h.height(); j++)
+        for(int i=0; i<h.width(); i++)
+            h(i,j) = byte((im(2*i,2*j)+im(2*i+1,2*j)+
+                           im(2*i,2*j+1)+im(2*i+1,2*j+1)+2)/4);
+    return h;
+}
+
+/// Coarse-to-fine disparity search. Full search at the coarsest level of
+/// image pyramids, then at each finer level search within pyramidRadius of
+/// the upsampled disparity of the coarser level. Pixels without coarse
+/// disparity get a full search.
+static void coarse_to_fine(CostVolume& C, Image<int>& disp, Image<float>& ncc) {
+    std::vector< Image<byte> > pyr1(1, C.engine().image1());
+    std::vector< Image<byte> > pyr2(1, C.engine().image2());
+    while(int(pyr1.size()) <= pyramidLevels &&
+          std::min(pyr1.back().height(),pyr2.back().height()) >= 8*win &&
+          std::min(pyr1.back().width(),pyr2.back().width()) >= 8*win) {
+        pyr1.push_back(half_size(pyr1.back()));
+        pyr2.push_back(half_size(pyr2.back()));
+    }
+    Image<int> coarse; // Disparity of previous level
+    int dmin_c=0;      // Its min disparity
+    for(int k=int(pyr1.size())-1; k>=0; k--) {
+        // Disparity range at level k
+        const int dmin_k = int(floor(dmin/double(1<<k)));
+        const int dmax_k = int(ceil(dmax/double(1<<k)));
+        auto range = [&](int x, int y, int& d0, int& d1) {
+            d0=dmin_k; d1=dmax_k;
+            if(coarse.width() == 0)
+                return;
+            const int xc = std::min(x/2, coarse.width()-1);
+            const int yc = std::min(y/2, coarse.height()-1);
+            const int dc = coarse(xc,yc);
+            if(dc < dmin_c) // No disparity at coarser level
+                return;
+            d0 = std::max(dmin_k, 2*dc-pyramidRadius);
+            d1 = std::min(dmax_k, 2*dc+pyramidRadius);
+        };
+        if(k == 0) {
+            search_disparity(C, pyr1[0], pyr2[0], range, disp, ncc, true);
+            break;
+        }
+        Image<int> level(pyr1[k].width(), pyr1[k].height());
+        Image<float> n(level.width(), level.height());
+        level.fill(dmin_k-1);
+        n.fill(0.0f);
+        NccEngine E(pyr1[k], pyr2[k]);
+        LevelScorer S(E);
+        search_disparity(S, pyr1[k], pyr2[k], range, level, n, false);
+        coarse = level;
+        dmin_c = dmin_k;
+    }
 }
 
 /// Compute disparity map from im1 to im2, but only at points where NCC is
 /// above nccSeed. Set to true the seeds and put them in Q.
-static void find_seeds(Image<byte> im1, Image<byte> im2,
+/// Seeds are pushed in Q in row order, so that the result does not depend
+/// on the number of threads. The NCC of each disparity is put in score if not
+/// null.
+static void find_seeds(CostVolume& C,
                        float nccSeed,
                        Image<int>& disp, Image<bool>& seeds,
-                       std::priority_queue<Seed>& Q) {
-
-
+                       std::priority_queue<Seed>& Q,
+                       Image<float>* score=0) {
     disp.fill(dmin-1);
     seeds.fill(false);
     while(! Q.empty())
         Q.pop();
 
+    const Image<byte>& im1=C.engine().image1();
+    const Image<byte>& im2=C.engine().image2();
+    Image<float> local;
+    if(! score) {
+        local = Image<float>(disp.width(), disp.height());
+        score = &local;
+    }
+    Image<float>& ncc = *score;
+    ncc.fill(0.0f);
+    if(pyramidLevels > 0)
+        coarse_to_fine(C, disp, ncc);
+    else
+        search_disparity(C, im1, im2, [](int, int, int& d0, int& d1) {
+            d0=dmin; d1=dmax;
+        }, disp, ncc, true);
+
     const int maxy = std::min(im1.height(),im2.height());
-    const int refreshStep = (maxy-2*win)*5/100;
-    for(int y=win; y+win<maxy; y++) {
-        if((y-win-1)/refreshStep != (y-win)/refreshStep)
-            std::cout << "Seeds: " << 5*(y-win)/refreshStep <<"%\r"<<std::flush;
-        for(int x=win; x+win<im1.width(); x++) {
-
-            float ncc_xy=0.0f;
-            // we go through all the image 2, to find the smallest distance
-                for(int di= dmin  ;di<=dmax;di++){
-                    if(x+di >= win && x+di < -win+im2.width()){
-                        float cor = ccorrel(im1,x,y,  im2,x+di,y);
-                        if(cor>ncc_xy){ ncc_xy= cor ;
-                        disp(x,y)=di;}//cout << "disp(x,y) " <<disp(x,y)<<"di" << di<<endl;}//sqrt(pow(di,2)+pow(dj,2));} //we have the maximum of NCC for the point (x,y)
-                    }}
-                    if (ncc_xy>nccSeed){seeds(x,y)=true;
-                        Q.push(Seed( x,  y, disp(x,y), ncc_xy));
-                      };
-            // ------------- TODO -------------
-            // Hint: just ignore windows that are not fully in image
+    for(int y=win; y+win<maxy; y++)
+        for(int x=win; x+win<im1.width(); x++)
+            if(ncc(x,y) > nccSeed) {
+                seeds(x,y) = true;
+                Q.push(Seed(x, y, disp(x,y), ncc(x,y)));
+            }
+}
+
+/// Match pixel (x,y), neighbor of seed s, with disparities s.d-1, s.d, s.d+1.
+/// Return false if none of them keeps the patch inside image 2.
+static bool match_neighbor(CostVolume& C, const Seed& s, int x, int y,
+                           Seed& m) {
+    const int w2 = C.engine().image2().width();
+    bool found=false;
+    for(int d=s.d-1; d<=s.d+1; d++)
+        if(win <= x+d && x+d < w2-win) {
+            float ncc = C.ccorrel(x,y, d);
+            if(!found || ncc>m.ncc) {
+                m = Seed(x, y, d, ncc);
+                found = true;
+            }
         }
-    }
-    std::cout << std::endl;
+    return found;
 }
 
-/// Propagate seeds
-static void propagate(Image<byte> im1, Image<byte> im2,
+/// Propagate seeds. The NCC of propagated pixels is put in score if not null.
+static void propagate(CostVolume& C,
                       Image<int>& disp, Image<bool>& seeds,
-                      std::priority_queue<Seed>& Q) {
+                      std::priority_queue<Seed>& Q,
+                      Image<float>* score=0) {
+    const Image<byte>& im1=C.engine().image1();
+    const Image<byte>& im2=C.engine().image2();
     const int maxy = std::min(im1.height(),im2.height());
 
-    //MultiArray<char,2> DISP;
-    //DISP =disp;
+    int n=0; // Number of propagated pixels
     while(! Q.empty()) {
         Seed s=Q.top();
         Q.pop();
-
         for(int i=0; i<4; i++) {
-            int x=s.x+dx[i], y=s.y+dy[i]; //coordinates of the neihbor of point (i,j) on image 1
+            int x=s.x+dx[i], y=s.y+dy[i];
+            Seed m(x,y,0,0.0f);
             if(0<=x-win && x+win<im1.width() && 0<=y-win && y+win<maxy &&
-               ! seeds(x,y)) {
-                float ncc = 0;
-                float d;
-
-                for(int n=-1;n<2;n++){// coordinates of the paired points on image 2 must be within image's frame
-                    if(win <= x+s.d+n && x+s.d+n<im1.width()-win){ //ensures that x+s.d+n doesn't go out of the image2
-                        float cor = ccorrel( im1, x, y, im2, x+s.d+n,y);
-                        if (cor>ncc){cout << "x=" << x << " y="<<y<<endl ; ncc=cor;
-                            d = s.d+n;};
-                    };
-                }
-                cout<< "we are out "<<endl;
-                    Q.push(Seed( x,  y, d, ncc));
-                    seeds(x,y) = true;
-                // ------------- TODO -------------
+               ! seeds(x,y) && match_neighbor(C, s, x, y, m)) {
+                disp(x,y) = m.d;
+                seeds(x,y) = true;
+                if(score)
+                    (*score)(x,y) = m.ncc;
+                Q.push(m);
+                ++n;
             }
         }
     }
+    if(verbose)
+        std::cout << "Propagation: " << n << " pixels" << std::endl;
 }
 
-int main(int argc, char* argv[]) {
+/// Lock-free multiple-producer single-consumer list of seeds handed over to
+/// a tile by its neighbors. The consumer takes the whole list at once.
+class Handoff {
+public:
+    Handoff(): head(0) {}
+    ~Handoff() { std::priority_queue<Seed> Q; drain(Q); }
+    bool empty() const { return head.load(std::memory_order_relaxed)==0; }
+    void push(const Seed& s) {
+        Node* n = new Node(s);
+        n->next = head.load(std::memory_order_relaxed);
+        while(! head.compare_exchange_weak(n->next, n,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+            ;
+    }
+    /// Move all seeds to Q and return their number.
+    int drain(std::priority_queue<Seed>& Q) {
+        Node* n = head.exchange(0, std::memory_order_acquire);
+        int k=0;
+        for(; n; k++) {
+            Q.push(n->s);
+            Node* next = n->next;
+            delete n;
+            n = next;
+        }
+        return k;
+    }
+private:
+    struct Node {
+        Node(const Seed& s0): s(s0), next(0) {}
+        Seed s;
+        Node* next;
+    };
+    std::atomic<Node*> head;
+};
+
+/// Tile of the image for parallel propagation. Only the thread holding the
+/// tile writes disp and seeds of its pixels.
+struct Tile {
+    Tile(): busy(false), top(-2.0f) {}
+    std::priority_queue<Seed> Q; ///< Seeds of the tile, best first
+    Handoff in;  ///< Neighbors of seeds of other tiles, to be matched here
+    std::atomic<bool> busy;      ///< Held by a thread
+    std::atomic<float> top;      ///< NCC of best seed in Q (-2 if empty)
+};
 
+/// Propagate seeds in parallel on tiles of size tileSize. Each tile has its
+/// own best-first queue, and a seed whose neighbor belongs to another tile
+/// hands it over to that tile. A tile is processed only while its best seed
+/// is within nccTolerance of the best seed of all tiles, so that best-first
+/// order holds up to this tolerance. The NCC of propagated pixels is put in
+/// score if not null.
+static void propagate_tiles(CostVolume& C,
+                            Image<int>& disp, Image<bool>& seeds,
+                            std::priority_queue<Seed>& Q,
+                            Image<float>* score=0) {
+    const Image<byte>& im1=C.engine().image1();
+    const Image<byte>& im2=C.engine().image2();
+    const int maxy = std::min(im1.height(),im2.height());
+    const int ntx = (im1.width()+tileSize-1)/tileSize;
+    const int nty = (maxy+tileSize-1)/tileSize;
+    std::vector<Tile> tiles(ntx*nty);
+    std::atomic<int> pending(int(Q.size())); // Seeds queued or handed over
+    for(; ! Q.empty(); Q.pop()) {
+        const Seed& s = Q.top();
+        tiles[s.x/tileSize + ntx*(s.y/tileSize)].Q.push(s);
+    }
+    for(size_t t=0; t<tiles.size(); t++)
+        if(! tiles[t].Q.empty())
+            tiles[t].top = tiles[t].Q.top().ncc;
+    std::atomic<int> propagated(0), handed(0);
+
+    // Match pixel (x,y) of tile T, reached from seed s
+    auto match = [&](Tile& T, const Seed& s, int x, int y) {
+        Seed m(x,y,0,0.0f);
+        if(0<=x-win && x+win<im1.width() && 0<=y-win && y+win<maxy &&
+           ! seeds(x,y) && match_neighbor(C, s, x, y, m)) {
+            disp(x,y) = m.d;
+            seeds(x,y) = true;
+            if(score)
+                (*score)(x,y) = m.ncc;
+            ++pending;
+            T.Q.push(m);
+            ++propagated;
+        }
+    };
+    const int batch=256; // Max seeds popped at each visit of a tile
+    Parallel::parallelFor(Parallel::pool().size(), [&](int) {
+        while(pending > 0) {
+            float frontier=-2.0f;
+            for(size_t t=0; t<tiles.size(); t++)
+                frontier = std::max(frontier, tiles[t].top.load());
+            bool work=false;
+            for(size_t t=0; t<tiles.size(); t++) {
+                Tile& T = tiles[t];
+                if(T.in.empty() && T.top < frontier-nccTolerance)
+                    continue;
+                bool expected=false;
+                if(! T.busy.compare_exchange_strong(expected, true))
+                    continue;
+                // Handed over seeds: match their neighbor in this tile
+                std::priority_queue<Seed> H;
+                const int nh = T.in.drain(H);
+                for(; ! H.empty(); H.pop())
+                    match(T, H.top(), H.top().x, H.top().y);
+                pending -= nh;
+                for(int k=0; k<batch && ! T.Q.empty() &&
+                        T.Q.top().ncc >= frontier-nccTolerance; k++) {
+                    Seed s=T.Q.top();
+                    T.Q.pop();
+                    for(int i=0; i<4; i++) {
+                        int x=s.x+dx[i], y=s.y+dy[i];
+                        if(x<0 || y<0 || x>=im1.width() || y>=maxy)
+                            continue;
+                        Tile& N = tiles[x/tileSize + ntx*(y/tileSize)];
+                        if(&N == &T)
+                            match(T, s, x, y);
+                        else { // Handed over with coordinates of neighbor
+                            ++pending;
+                            N.in.push(Seed(x, y, s.d, s.ncc));
+                            ++handed;
+                        }
+                    }
+                    --pending;
+                    work = true;
+                }
+                T.top = T.Q.empty()? -2.0f: T.Q.top().ncc;
+                T.busy = false;
+            }
+            if(! work)
+                std::this_thread::yield();
+        }
+    });
+    if(verbose)
+        std::cout << "Propagation: " << propagated << " pixels, "
+                  << handed << " handed over between " << tiles.size()
+                  << " tiles" << std::endl;
+}
+
+/// Max drop of NCC for the disparity of the previous frame to be kept
+static const float nccDrift=0.1f;
+/// Min NCC of a disparity kept from the previous frame
+static const float nccTemporal=0.5f;
+/// Added to the NCC of temporal seeds so that they are propagated first
+static const float temporalPriority=2.0f;
+
+/// Seeds of a video frame from disparity prev of the previous frame, of NCC
+/// prevNcc. If the NCC of a pixel has dropped, its best disparity within 1 of
+/// the previous one is taken, as in propagation. It is kept if its NCC has not
+/// dropped by more than nccDrift and is at least nccTemporal. Blocks of
+/// bandHeight x bandHeight pixels where fewer than half of the previous
+/// disparities are kept get the full search of find_seeds. Seeds are put in Q
+/// only if they have a neighbor to propagate to. NCC of seeds is put in ncc.
+/// blocks is scratch memory. Return the number of blocks searched.
+static int temporal_seeds(CostVolume& C,
+                          const Image<int>& prev, const Image<float>& prevNcc,
+                          Image<int>& disp, Image<float>& ncc,
+                          Image<bool>& seeds, std::priority_queue<Seed>& Q,
+                          std::vector<int>& blocks) {
+    disp.fill(dmin-1);
+    ncc.fill(0.0f);
+    seeds.fill(false);
+    while(! Q.empty())
+        Q.pop();
+
+    const Image<byte>& im1=C.engine().image1();
+    const Image<byte>& im2=C.engine().image2();
+    const int w=im1.width(), w2=im2.width();
+    const int maxy = std::min(im1.height(),im2.height());
+    const int bw=(w+bandHeight-1)/bandHeight, bh=(maxy+bandHeight-1)/bandHeight;
+    blocks.assign(2*bw*bh, 0); // Disparities tried and kept in each block
+
+    // Verification, a row of blocks per task
+    Parallel::parallelFor(bh, [&](int b) {
+        const int y1 = std::min(maxy-win, (b+1)*bandHeight);
+        for(int y=std::max(win,b*bandHeight); y<y1; y++)
+            for(int x=win; x+win<w; x++) {
+                const int d = prev(x,y);
+                if(d<dmin || d>dmax || x+d<win || x+d+win>=w2)
+                    continue;
+                int* k = &blocks[2*(x/bandHeight+bw*b)];
+                ++k[0];
+                Seed m(x, y, d, C.ccorrel(x,y, d));
+                if(m.ncc < prevNcc(x,y)) { // Image changed: d-1, d or d+1
+                    const Seed p=m;
+                    match_neighbor(C, p, x, y, m);
+                }
+                if(m.ncc >= std::max(nccTemporal, prevNcc(x,y)-nccDrift)) {
+                    disp(x,y) = m.d;
+                    ncc(x,y) = m.ncc;
+                    seeds(x,y) = true;
+                    ++k[1];
+                }
+            }
+    });
+
+    // Full search in failed blocks
+    int searched=0;
+    for(int b=0; b<bw*bh; b++)
+        if(2*blocks[2*b+1] < blocks[2*b] || blocks[2*b]==0) {
+            blocks[2*b] = -1; // Mark as failed
+            ++searched;
+        }
+    if(searched > 0)
+        search_disparity(C, im1, im2, [&](int x, int y, int& d0, int& d1) {
+            d0=dmin; d1=dmax;
+            if(seeds(x,y) || blocks[2*(x/bandHeight+bw*(y/bandHeight))]>=0) {
+                d0=1; d1=0; // No search
+            }
+        }, disp, ncc, false);
+
+    // Seeds in row order, temporal seeds first
+    for(int y=win; y+win<maxy; y++)
+        for(int x=win; x+win<w; x++)
+            if(seeds(x,y)) {
+                bool border=false;
+                for(int i=0; i<4 && !border; i++) {
+                    const int xn=x+dx[i], yn=y+dy[i];
+                    border = win<=xn && xn+win<w && win<=yn && yn+win<maxy &&
+                             ! seeds(xn,yn);
+                }
+                if(border)
+                    Q.push(Seed(x, y, disp(x,y), ncc(x,y)+temporalPriority));
+            } else if(ncc(x,y) > nccSeed) { // Found by full search
+                seeds(x,y) = true;
+                Q.push(Seed(x, y, disp(x,y), ncc(x,y)));
+            }
+    return searched;
+}
 
+/// Disparity maps of a stereo video, the file list holding the pair "im1 im2"
+/// of each frame on a line. The first frame is processed as a single pair;
+/// the next ones start from the temporal seeds of the previous frame. Images
+/// must have the same size in all frames, so that buffers are allocated once.
+/// Return 0 on success.
+static int video(const string& list, BenchReport& bench) {
+    std::ifstream f(list.c_str());
+    std::vector<string> files1, files2;
+    for(string f1, f2; f >> f1 >> f2; ) {
+        files1.push_back(f1);
+        files2.push_back(f2);
+    }
+    if(files1.empty()) {
+        cerr << "No image pair in " << list << endl;
+        return 1;
+    }
+    bench.start("first frame");
+    Image<Color> I1, I2;
+    if(!load(I1,files1[0]) || !load(I2,files2[0])) {
+        cerr << "Error loading " << files1[0] << ' ' << files2[0] << endl;
+        return 1;
+    }
+    const int w=I1.width(), h=I1.height();
+    Window W = 0;
+#ifndef HEADLESS
+    std::string names[5]={"image 1","image 2","dense","seeds","propagation"};
+    W = openComplexWindow(w, h, "Seeds propagation", 5, names);
+#endif
+    NccEngine E(I1, I2);
+    CostVolume C(E, volumeMB);
+    Image<int> disp(w,h), prev(w,h);
+    Image<float> ncc(w,h), prevNcc(w,h);
+    Image<bool> seeds(w,h);
+    std::priority_queue<Seed> Q;
+    std::vector<int> blocks;
+    find_seeds(C, nccSeed, disp, seeds, Q, &ncc);
+    if(tileSize > 0)
+        propagate_tiles(C, disp, seeds, Q, &ncc);
+    else
+        propagate(C, disp, seeds, Q, &ncc);
+    save(displayDisp(disp,W,4), outPath("frame0000.png"));
+    bench.stop();
+    bench.setWork(double(w)*h);
+
+    bench.start("next frames", double(w)*h*(files1.size()-1));
+    for(size_t k=1; k<files1.size(); k++) {
+        if(!load(I1,files1[k]) || !load(I2,files2[k]) ||
+           I1.width()!=w || I1.height()!=h ||
+           I2.width()!=E.image2().width() || I2.height()!=E.image2().height()) {
+            cerr << "Error loading " << files1[k] << ' ' << files2[k]
+                 << " (same size as first frame expected)" << endl;
+            return 1;
+        }
+#ifndef HEADLESS
+        setActiveWindow(W,0);
+        display(I1,0,0);
+        setActiveWindow(W,1);
+        display(I2,0,0);
+#endif
+        E.reset(I1, I2);
+        C.clear();
+        std::swap(disp, prev);
+        std::swap(ncc, prevNcc);
+        const int searched = temporal_seeds(C, prev, prevNcc, disp, ncc,
+                                            seeds, Q, blocks);
+        if(verbose)
+            std::cout << "Frame " << k << ": " << searched
+                      << " blocks searched, " << Q.size() << " seeds queued"
+                      << std::endl;
+        if(tileSize > 0)
+            propagate_tiles(C, disp, seeds, Q, &ncc);
+        else
+            propagate(C, disp, seeds, Q, &ncc);
+        char name[32];
+        sprintf(name, "frame%04d.png", int(k));
+        save(displayDisp(disp,W,4), outPath(name));
+    }
+    bench.stop();
+#ifndef HEADLESS
+    endGraphics();
+#endif
+    return 0;
+}
 
-    if(argc!=1 && argc!=5) {
-        cerr << "Usage: " << argv[0] << " im1 im2 dmin dmax" << endl;
+int main(int argc, char* argv[]) {
+    // Options (--name=value) come before positional arguments
+    string jsonFile; // Stage timings
+    string videoFile; // Pairs of a stereo video, one per line
+    string plyFile; // 3D points
+    int a=1;
+    for(; a<argc && string(argv[a]).compare(0,2,"--")==0; a++) {
+        string opt(argv[a]);
+        if(opt.compare(0,9,"--volume=")==0)
+            volumeMB = stoi(opt.substr(9));
+        else if(opt.compare(0,10,"--threads=")==0)
+            nThreads = stoi(opt.substr(10));
+        else if(opt.compare(0,8,"--tiles=")==0)
+            tileSize = stoi(opt.substr(8));
+        else if(opt.compare(0,12,"--tolerance=")==0)
+            nccTolerance = stof(opt.substr(12));
+        else if(opt.compare(0,10,"--pyramid=")==0)
+            pyramidLevels = stoi(opt.substr(10));
+        else if(opt.compare(0,9,"--radius=")==0)
+            pyramidRadius = stoi(opt.substr(9));
+        else if(opt=="--verbose")
+            verbose = true;
+        else if(opt.compare(0,6,"--out=")==0)
+            outDir = opt.substr(6);
+        else if(opt.compare(0,7,"--json=")==0)
+            jsonFile = opt.substr(7);
+        else if(opt.compare(0,8,"--video=")==0)
+            videoFile = opt.substr(8);
+        else if(opt.compare(0,6,"--ply=")==0)
+            plyFile = opt.substr(6);
+        else {
+            cerr << "Unknown option " << opt << endl;
+            return 1;
+        }
+    }
+    if(videoFile.empty()? (argc-a!=0 && argc-a!=4): (argc-a!=0 && argc-a!=2)) {
+        cerr << "Usage: " << argv[0] << " [--volume=MB] [--threads=N]"
+             << " [--pyramid=L] [--radius=R]"
+             << " [--tiles=N] [--tolerance=T] [--verbose]"
+             << " [--out=dir] [--json=file] [--ply=file]"
+             << " im1 im2 dmin dmax" << endl
+             << "       " << argv[0] << " --video=pairs.txt [options]"
+             << " dmin dmax" << endl;
         return 1;
     }
+    Parallel::pool(nThreads);
+    if(! videoFile.empty()) {
+        if(argc > a) {
+            dmin=stoi(argv[a]); dmax=stoi(argv[a+1]);
+        }
+        BenchReport bench("Seeds");
+        const int status = video(videoFile, bench);
+        if(! jsonFile.empty() && ! bench.write(jsonFile))
+            cerr << "Error writing " << jsonFile << endl;
+        return status;
+    }
     const char *im1=DEF_im1, *im2=DEF_im2;
-    if(argc>1) {
-        im1 = argv[1]; im2=argv[2]; dmin=stoi(argv[3]); dmax=stoi(argv[4]);
+    if(argc>a) {
+        im1 = argv[a]; im2=argv[a+1]; dmin=stoi(argv[a+2]); dmax=stoi(argv[a+3]);
     }
     // Load and display images
     Image<Color> I1, I2;
@@ -233,37 +888,64 @@ int main(int argc, char* argv[]) {
         cerr<< "Error loading image files" << endl;
         return 1;
     }
+    Window W = 0;
+#ifndef HEADLESS
     std::string names[5]={"image 1","image 2","dense","seeds","propagation"};
-    Window W = openComplexWindow(I1.width(), I1.height(), "Seeds propagation",
-                                 5, names);
-    // Cropping I1 and I2
-    // A=C.getSubImage(Coords<2>(1,1),Coords<2>(10,10));
-
-
+    W = openComplexWindow(I1.width(), I1.height(), "Seeds propagation",
+                          5, names);
     setActiveWindow(W,0);
     display(I1,0,0);
     setActiveWindow(W,1);
     display(I2,0,0);
+#endif
 
     Image<int> disp(I1.width(), I1.height());
     Image<bool> seeds(I1.width(), I1.height());
     std::priority_queue<Seed> Q;
+    BenchReport bench("Seeds");
+    const double work = double(I1.width())*I1.height()*(dmax-dmin+1);
+    bench.start("engine", double(I1.width())*I1.height());
+    NccEngine E(I1, I2);
+    CostVolume C(E, volumeMB);
+    bench.stop();
 
     // Dense disparity
-    find_seeds(I1, I2, -1.0f, disp, seeds, Q);
-    save(displayDisp(disp,W,2), srcPath("0dense.png"));
+    bench.start("dense", work);
+    find_seeds(C, -1.0f, disp, seeds, Q);
+    bench.stop();
+    save(displayDisp(disp,W,2), outPath("0dense.png"));
 
     // Only seeds
-    find_seeds(I1, I2, nccSeed, disp, seeds, Q);
-    save(displayDisp(disp,W,3), srcPath("1seeds.png"));
+    bench.start("seeds", work);
+    find_seeds(C, nccSeed, disp, seeds, Q);
+    bench.stop();
+    save(displayDisp(disp,W,3), outPath("1seeds.png"));
 
     // Propagation of seeds
-    propagate(I1, I2, disp, seeds, Q);
-    save(displayDisp(disp,W,4), srcPath("2final.png"));
+    bench.start("propagation", double(I1.width())*I1.height());
+    if(tileSize > 0)
+        propagate_tiles(C, disp, seeds, Q);
+    else
+        propagate(C, disp, seeds, Q);
+    bench.stop();
+    save(displayDisp(disp,W,4), outPath("2final.png"));
+
+    if(! plyFile.empty()) {
+        bench.start("ply", double(I1.width())*I1.height());
+        const bool written = writePLY(plyFile, I1, disp);
+        bench.stop();
+        if(! written)
+            cerr << "Error writing " << plyFile << endl;
+    }
+
+    if(! jsonFile.empty() && ! bench.write(jsonFile))
+        cerr << "Error writing " << jsonFile << endl;
 
+#ifndef HEADLESS
     // Show 3D (use shift click to animate)
     show3D(I1,disp);
 
     endGraphics();
+#endif
     return 0;
 }
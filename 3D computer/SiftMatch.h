@@ -0,0 +1,387 @@
+// Imagine++ project
+// Project:  Fundamental / Panorama
+// Matching of SIFT descriptors (128 floats) between two images: a KD-tree over
+// the descriptors of image 2 is searched best bin first (Beis and Lowe, CVPR
+// 1997) for the two nearest neighbors of each descriptor of image 1, and
+// matches are kept by Lowe's ratio test, optionally only if mutual.
+// Exact search compares all pairs with cache-blocked dot products (as in a
+// matrix product), SSE or AVX2 selected at runtime.
+// Link with -pthread.
+
+#ifndef SIFTMATCH_H
+#define SIFTMATCH_H
+
+#include "Parallel.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIFT_MATCH_X86
+#endif
+
+namespace SiftMatch {
+
+const int DIM = 128; ///< Dimension of descriptors
+
+/// Squared Euclidean distance between descriptors
+inline float dist2(const float* a, const float* b) {
+    float s[4] = {0,0,0,0}; // Independent sums, for vectorization
+    for(int k=0; k<DIM; k+=4)
+        for(int l=0; l<4; l++) {
+            const float d = a[k+l]-b[k+l];
+            s[l] += d*d;
+        }
+    return (s[0]+s[1])+(s[2]+s[3]);
+}
+
+/// Two nearest neighbors of a descriptor and their squared distances (-1 and
+/// FLT_MAX when absent)
+struct Neighbors {
+    int i1, i2;
+    float d1, d2;
+    /// Update with descriptor i at squared distance d. Among equal distances
+    /// the first inserted is kept.
+    void insert(int i, float d) {
+        if(d < d1) {
+            i2 = i1; d2 = d1;
+            i1 = i; d1 = d;
+        } else if(d < d2) {
+            i2 = i; d2 = d;
+        }
+    }
+};
+
+/// KD-tree over n descriptors, rows of data (not copied)
+class KDTree {
+public:
+    KDTree(const float* data, int n);
+    /// Two nearest neighbors of q, examining at most `checks` descriptors
+    /// (0: all, with a weaker bound)
+    Neighbors search(const float* q, int checks) const;
+private:
+    struct Node {
+        int dim;        ///< Split dimension, -1 for a leaf
+        float split;    ///< Descriptors with value < split go left
+        int child[2];
+        int begin, end; ///< Range of index for a leaf
+    };
+    enum { LEAF_SIZE=8 };
+    int build(int begin, int end);
+    const float* data;
+    std::vector<int> index; ///< Descriptors, each leaf owning a range
+    std::vector<Node> nodes;
+};
+
+inline KDTree::KDTree(const float* data0, int n): data(data0), index(n) {
+    for(int i=0; i<n; i++)
+        index[i] = i;
+    if(n > 0)
+        build(0, n);
+}
+
+/// Split on the dimension of largest variance (estimated on a sample) at
+/// the median. Return node number.
+inline int KDTree::build(int begin, int end) {
+    const int id = int(nodes.size());
+    Node node = {-1, 0, {-1,-1}, begin, end};
+    nodes.push_back(node);
+    if(end-begin <= LEAF_SIZE)
+        return id;
+    const int step = std::max(1, (end-begin)/128);
+    float best=-1;
+    for(int k=0; k<DIM; k++) {
+        double s=0, s2=0;
+        int m=0;
+        for(int i=begin; i<end; i+=step, m++) {
+            const float v = data[index[i]*DIM+k];
+            s += v;
+            s2 += v*v;
+        }
+        const float var = float(s2/m - (s/m)*(s/m));
+        if(var > best) {
+            best = var;
+            node.dim = k;
+        }
+    }
+    const int mid = (begin+end)/2, k=node.dim;
+    std::nth_element(index.begin()+begin, index.begin()+mid, index.begin()+end,
+                     [&](int a, int b) { return data[a*DIM+k]<data[b*DIM+k]; });
+    node.split = data[index[mid]*DIM+k];
+    node.child[0] = build(begin, mid);
+    node.child[1] = build(mid, end);
+    nodes[id] = node;
+    return id;
+}
+
+inline Neighbors KDTree::search(const float* q, int checks) const {
+    Neighbors r = {-1, -1, FLT_MAX, FLT_MAX};
+    if(nodes.empty())
+        return r;
+    // Branches to explore, by increasing lower bound of their distance
+    typedef std::pair<float,int> Branch;
+    std::priority_queue<Branch, std::vector<Branch>,
+                        std::greater<Branch> > branches;
+    branches.push(Branch(0.0f,0));
+    int checked=0;
+    while(! branches.empty()) {
+        const float bound = branches.top().first;
+        int id = branches.top().second;
+        branches.pop();
+        if(bound >= r.d2 || (checks>0 && checked>=checks))
+            break;
+        // Descend to a leaf, keeping the other side of each split
+        while(nodes[id].dim >= 0) {
+            const Node& n = nodes[id];
+            const float diff = q[n.dim]-n.split;
+            const int near = (diff<0)? 0: 1;
+            // Exact search needs a true lower bound. Accumulating the
+            // offsets of all splits (as FLANN) orders bins better.
+            const float b = (checks>0)? bound+diff*diff:
+                                        std::max(bound,diff*diff);
+            branches.push(Branch(b, n.child[1-near]));
+            id = n.child[near];
+        }
+        for(int i=nodes[id].begin; i<nodes[id].end; i++, checked++)
+            r.insert(index[i], dist2(q, data+index[i]*DIM));
+    }
+    return r;
+}
+
+/// Dot products of 4 descriptors a[0..3] with the nb consecutive descriptors
+/// b: out[4*j+2*i+t] = a[i].b[j+t] for even j. If nb is odd, the last one is
+/// repeated, out must hold 4*(nb+1) values.
+typedef void (*DotKernel)(const float* const a[4], const float* b, int nb,
+                          float* out);
+
+inline void dotScalar(const float* const a[4], const float* b, int nb,
+                      float* out) {
+    for(int j=0; j<nb; j+=2)
+        for(int i=0; i<4; i++)
+            for(int t=0; t<2; t++) {
+                const float* bj = b + std::min(j+t,nb-1)*DIM;
+                float s=0;
+                for(int k=0; k<DIM; k++)
+                    s += a[i][k]*bj[k];
+                out[4*j+2*i+t] = s;
+            }
+}
+
+#ifdef SIFT_MATCH_X86
+__attribute__((target("sse3")))
+inline void dotSSE(const float* const a[4], const float* b, int nb,
+                   float* out) {
+    for(int j=0; j<nb; j+=2) {
+        const float *b0=b+j*DIM, *b1=b+std::min(j+1,nb-1)*DIM;
+        // Named accumulators so that they stay in registers
+        __m128 s00=_mm_setzero_ps(), s01=s00, s10=s00, s11=s00,
+               s20=s00, s21=s00, s30=s00, s31=s00;
+        for(int k=0; k<DIM; k+=4) {
+            const __m128 v0=_mm_loadu_ps(b0+k), v1=_mm_loadu_ps(b1+k);
+            __m128 ai = _mm_loadu_ps(a[0]+k);
+            s00 = _mm_add_ps(s00, _mm_mul_ps(ai,v0));
+            s01 = _mm_add_ps(s01, _mm_mul_ps(ai,v1));
+            ai = _mm_loadu_ps(a[1]+k);
+            s10 = _mm_add_ps(s10, _mm_mul_ps(ai,v0));
+            s11 = _mm_add_ps(s11, _mm_mul_ps(ai,v1));
+            ai = _mm_loadu_ps(a[2]+k);
+            s20 = _mm_add_ps(s20, _mm_mul_ps(ai,v0));
+            s21 = _mm_add_ps(s21, _mm_mul_ps(ai,v1));
+            ai = _mm_loadu_ps(a[3]+k);
+            s30 = _mm_add_ps(s30, _mm_mul_ps(ai,v0));
+            s31 = _mm_add_ps(s31, _mm_mul_ps(ai,v1));
+        }
+        // Horizontal sums of 4 accumulators at once
+        _mm_storeu_ps(out+4*j, _mm_hadd_ps(_mm_hadd_ps(s00,s01),
+                                           _mm_hadd_ps(s10,s11)));
+        _mm_storeu_ps(out+4*j+4, _mm_hadd_ps(_mm_hadd_ps(s20,s21),
+                                             _mm_hadd_ps(s30,s31)));
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void dotAVX2(const float* const a[4], const float* b, int nb,
+                    float* out) {
+    for(int j=0; j<nb; j+=2) {
+        const float *b0=b+j*DIM, *b1=b+std::min(j+1,nb-1)*DIM;
+        __m256 s00=_mm256_setzero_ps(), s01=s00, s10=s00, s11=s00,
+               s20=s00, s21=s00, s30=s00, s31=s00;
+        for(int k=0; k<DIM; k+=8) {
+            const __m256 v0=_mm256_loadu_ps(b0+k), v1=_mm256_loadu_ps(b1+k);
+            __m256 ai = _mm256_loadu_ps(a[0]+k);
+            s00 = _mm256_fmadd_ps(ai, v0, s00);
+            s01 = _mm256_fmadd_ps(ai, v1, s01);
+            ai = _mm256_loadu_ps(a[1]+k);
+            s10 = _mm256_fmadd_ps(ai, v0, s10);
+            s11 = _mm256_fmadd_ps(ai, v1, s11);
+            ai = _mm256_loadu_ps(a[2]+k);
+            s20 = _mm256_fmadd_ps(ai, v0, s20);
+            s21 = _mm256_fmadd_ps(ai, v1, s21);
+            ai = _mm256_loadu_ps(a[3]+k);
+            s30 = _mm256_fmadd_ps(ai, v0, s30);
+            s31 = _mm256_fmadd_ps(ai, v1, s31);
+        }
+        // Horizontal sums of the 8 accumulators at once
+        const __m256 u0 = _mm256_hadd_ps(_mm256_hadd_ps(s00,s01),
+                                         _mm256_hadd_ps(s10,s11));
+        const __m256 u1 = _mm256_hadd_ps(_mm256_hadd_ps(s20,s21),
+                                         _mm256_hadd_ps(s30,s31));
+        _mm256_storeu_ps(out+4*j,
+                         _mm256_add_ps(_mm256_permute2f128_ps(u0,u1,0x20),
+                                       _mm256_permute2f128_ps(u0,u1,0x31)));
+    }
+}
+#endif
+
+/// Best dot product kernel for this CPU
+inline DotKernel dotKernel() {
+#ifdef SIFT_MATCH_X86
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return dotAVX2;
+    if(__builtin_cpu_supports("sse3"))
+        return dotSSE;
+#endif
+    return dotScalar;
+}
+
+/// Exact two nearest neighbors among the n descriptors d of each of the m
+/// descriptors q. Distances ||a||^2+||b||^2-2a.b are computed by blocks of
+/// descriptors that stay in cache, keeping the best candidates of each
+/// query. These are then compared with dist2, so that the result is the same
+/// as a comparison of all pairs with dist2.
+inline std::vector<Neighbors> exactNeighbors(const float* q, int m,
+                                             const float* d, int n) {
+    static const DotKernel dot = dotKernel();
+    enum { QBLOCK=32, DBLOCK=512, K=8 }; // K candidates per query
+    std::vector<float> qn(m), dn(n);     // Squared norms
+    const float zero[DIM] = {0};
+    for(int i=0; i<m; i++)
+        qn[i] = dist2(q+i*DIM, zero);
+    float dnMax=0;
+    for(int j=0; j<n; j++)
+        dnMax = std::max(dnMax, dn[j]=dist2(d+j*DIM, zero));
+    std::vector<Neighbors> res(m);
+    Parallel::parallelFor((m+QBLOCK-1)/QBLOCK, [&](int blk) {
+        const int q0=blk*QBLOCK, q1=std::min(m,q0+QBLOCK);
+        // Best candidates of each query, by increasing distance
+        std::vector<float> cd(QBLOCK*K, FLT_MAX);
+        std::vector<int> ci(QBLOCK*K, -1);
+        std::vector<float> out(4*(DBLOCK+1));
+        for(int d0=0; d0<n; d0+=DBLOCK) {
+            const int d1=std::min(n,d0+DBLOCK);
+            for(int i=q0; i<q1; i+=4) {
+                const float* a[4];
+                for(int l=0; l<4; l++) // Repeat last row of an incomplete block
+                    a[l] = q + std::min(i+l,q1-1)*DIM;
+                dot(a, d+d0*DIM, d1-d0, &out[0]);
+                for(int l=0; l<4 && i+l<q1; l++) {
+                    float* c = &cd[(i+l-q0)*K];
+                    int* ic = &ci[(i+l-q0)*K];
+                    for(int j=d0; j<d1; j++) {
+                        const int o = j-d0;
+                        const float e = qn[i+l]+dn[j]-2*out[4*(o&~1)+2*l+(o&1)];
+                        if(e >= c[K-1])
+                            continue;
+                        int k=K-1;
+                        for(; k>0 && c[k-1]>e; k--) {
+                            c[k] = c[k-1];
+                            ic[k] = ic[k-1];
+                        }
+                        c[k] = e;
+                        ic[k] = j;
+                    }
+                }
+            }
+        }
+        // Exact distances of candidates, in the order of a full scan
+        for(int i=q0; i<q1; i++) {
+            int* ic = &ci[(i-q0)*K];
+            std::sort(ic, ic+std::min(int(K),n));
+            Neighbors r = {-1, -1, FLT_MAX, FLT_MAX};
+            for(int k=0; k<std::min(int(K),n); k++)
+                r.insert(ic[k], dist2(q+i*DIM, d+ic[k]*DIM));
+            // Bound on rounding errors of both distance computations. A
+            // descriptor that is not a candidate may still be second if its
+            // distance is close to the last candidate: check all of them.
+            const float err = 512*FLT_EPSILON*(qn[i]+dnMax);
+            if(n>K && !(r.d2 < cd[(i-q0)*K+K-1]-err)) {
+                r.i1 = r.i2 = -1;
+                r.d1 = r.d2 = FLT_MAX;
+                for(int j=0; j<n; j++)
+                    r.insert(j, dist2(q+i*DIM, d+j*DIM));
+            }
+            res[i] = r;
+        }
+    });
+    return res;
+}
+
+/// Descriptors of features (with member desc of DIM values, as Imagine++
+/// SIFT), one row each
+template <class Features>
+std::vector<float> descriptors(const Features& feats) {
+    std::vector<float> d(feats.size()*DIM);
+    for(size_t i=0; i<feats.size(); i++)
+        for(int k=0; k<DIM; k++)
+            d[i*DIM+k] = feats[i].desc[k];
+    return d;
+}
+
+/// Match between descriptor i of image 1 and j of image 2
+struct Pair {
+    int i, j;
+    float d; ///< Squared distance
+};
+
+/// Parameters of matching
+struct Options {
+    Options(): ratio(0.8f), mutual(false), checks(128) {}
+    float ratio; ///< Max ratio of distances to first and second neighbors
+    bool mutual; ///< Keep only matches that are also best from image 2
+    int checks;  ///< Descriptors examined per query (0: exact search)
+};
+
+/// Two nearest neighbors among n descriptors d of each of m descriptors q,
+/// by KD-tree or exact search according to checks (see Options).
+inline std::vector<Neighbors> neighbors(const float* q, int m,
+                                        const float* d, int n, int checks) {
+    if(checks <= 0)
+        return exactNeighbors(q, m, d, n);
+    KDTree T(d, n);
+    std::vector<Neighbors> res(m);
+    const int block=64;
+    Parallel::parallelFor((m+block-1)/block, [&](int b) {
+        for(int i=b*block; i<std::min(m,(b+1)*block); i++)
+            res[i] = T.search(q+i*DIM, checks);
+    });
+    return res;
+}
+
+/// Match n1 descriptors d1 of image 1 with n2 descriptors d2 of image 2.
+/// Queries run in parallel on the shared pool.
+inline std::vector<Pair> match(const float* d1, int n1,
+                               const float* d2, int n2, const Options& o) {
+    std::vector<Neighbors> nn = neighbors(d1, n1, d2, n2, o.checks);
+    std::vector<Neighbors> back; // Neighbors in image 1 of descriptors of 2
+    if(o.mutual)
+        back = neighbors(d2, n2, d1, n1, o.checks);
+    const float r2 = o.ratio*o.ratio;
+    std::vector<Pair> pairs;
+    for(int i=0; i<n1; i++) {
+        const Neighbors& r = nn[i];
+        if(r.i1<0 || !(r.d1 < r2*r.d2) || (o.mutual && back[r.i1].i1!=i))
+            continue;
+        Pair p = {i, r.i1, r.d1};
+        pairs.push_back(p);
+    }
+    return pairs;
+}
+
+} // namespace SiftMatch
+
+#endif
@@ -0,0 +1,87 @@
+// Imagine++ project
+// Project:  Panorama
+// Raw store of square color tiles, for images too large to hold in memory.
+// Tiles are written in any order, from any thread, at offsets reserved
+// atomically; the header and the index are written at the end. File layout
+// (native byte order):
+//   char     magic[8]    "TILES001"
+//   uint32   width, height, tileSize, channels (3)
+//   uint64   offset[nx*ny]  of tile (tx,ty) at tx+nx*ty, 0 if never written
+//            (background)
+//   tiles    tileSize^2 RGB pixels by rows, padded at right and bottom edges
+// Uses POSIX pwrite, so that threads need no lock.
+
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <Imagine/Images.h>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class TileWriter {
+public:
+    /// Create file for a w x h image cut in tiles of size x size pixels. No
+    /// file (ok() is false) unless size is at least 1.
+    TileWriter(const std::string& fileName, int w, int h, int size);
+    ~TileWriter() { close(); }
+    bool ok() const { return fd >= 0 && !failed; }
+    int tilesX() const { return nx; }
+    int tilesY() const { return ny; }
+    int tileSize() const { return size; }
+    /// Write tile (tx,ty), size^2 pixels by rows. Thread-safe.
+    void write(int tx, int ty, const Imagine::Color* pixels);
+    /// Write header and index and close the file. Return false on error.
+    bool close();
+private:
+    int fd;
+    int w, h, size, nx, ny;
+    std::vector<uint64_t> index;
+    std::atomic<uint64_t> end; ///< End of tile data
+    std::atomic<bool> failed;
+    enum { HEADER=8+4*4 };
+};
+
+inline TileWriter::TileWriter(const std::string& fileName,
+                              int w0, int h0, int size0)
+: w(w0), h(h0), size(size0),
+  nx(size0>0? (w0+size0-1)/size0: 0), ny(size0>0? (h0+size0-1)/size0: 0),
+  index(size_t(nx)*ny, 0), end(HEADER+8*uint64_t(nx)*ny), failed(false) {
+    fd = (size0>0)? open(fileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644): -1;
+}
+
+inline void TileWriter::write(int tx, int ty, const Imagine::Color* pixels) {
+    const uint64_t bytes = uint64_t(size)*size*3;
+    const uint64_t offset = end.fetch_add(bytes);
+    const char* p = reinterpret_cast<const char*>(pixels);
+    for(uint64_t done=0; done<bytes; ) {
+        const ssize_t n = pwrite(fd, p+done, bytes-done, off_t(offset+done));
+        if(n <= 0) {
+            failed = true;
+            return;
+        }
+        done += n;
+    }
+    index[tx+size_t(nx)*ty] = offset; // Distinct tiles: no race
+}
+
+inline bool TileWriter::close() {
+    if(fd < 0)
+        return false;
+    char header[HEADER];
+    memcpy(header, "TILES001", 8);
+    const uint32_t dims[4] = {uint32_t(w), uint32_t(h), uint32_t(size), 3};
+    memcpy(header+8, dims, sizeof(dims));
+    bool good = ok() &&
+        pwrite(fd, header, HEADER, 0) == HEADER &&
+        pwrite(fd, &index[0], 8*index.size(), HEADER) == ssize_t(8*index.size());
+    good = (::close(fd) == 0) && good;
+    fd = -1;
+    return good;
+}
+
+#endif
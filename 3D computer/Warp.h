@@ -0,0 +1,151 @@
+// Imagine++ project
+// Project:  Panorama
+// Warp of a color image by a homography, one output row at a time: the
+// homogeneous source coordinates are stepped along the row and divided 8
+// (AVX) or 4 (SSE) pixels at a time, the version being selected at runtime.
+// Pixels are then sampled bilinearly with fixed-point weights.
+
+#ifndef WARP_H
+#define WARP_H
+
+#include <Imagine/Images.h>
+#include "Blend.h"
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WARP_X86
+#endif
+
+namespace Warp {
+
+using Imagine::Color;
+using Imagine::byte;
+
+/// Source points (u[i],v[i]) of pixels i in [0,n) of a row: (a+i*d) divided
+/// by its third coordinate, a being the homogeneous source point of pixel 0
+/// and d the step from one pixel to the next.
+typedef void (*ProjectKernel)(const float a[3], const float d[3], int n,
+                              float* u, float* v);
+
+inline void projectScalar(const float a[3], const float d[3], int n,
+                          float* u, float* v) {
+    for(int i=0; i<n; i++) {
+        const float w = 1/(a[2]+i*d[2]);
+        u[i] = (a[0]+i*d[0])*w;
+        v[i] = (a[1]+i*d[1])*w;
+    }
+}
+
+#ifdef WARP_X86
+__attribute__((target("sse2")))
+inline void projectSSE(const float a[3], const float d[3], int n,
+                       float* u, float* v) {
+    const __m128 one=_mm_set1_ps(1), four=_mm_set1_ps(4);
+    const __m128 a0=_mm_set1_ps(a[0]), a1=_mm_set1_ps(a[1]), a2=_mm_set1_ps(a[2]);
+    const __m128 d0=_mm_set1_ps(d[0]), d1=_mm_set1_ps(d[1]), d2=_mm_set1_ps(d[2]);
+    __m128 i4 = _mm_setr_ps(0,1,2,3);
+    int i=0;
+    for(; i+4<=n; i+=4, i4=_mm_add_ps(i4,four)) {
+        const __m128 w = _mm_div_ps(one, _mm_add_ps(a2, _mm_mul_ps(i4,d2)));
+        _mm_storeu_ps(u+i, _mm_mul_ps(_mm_add_ps(a0, _mm_mul_ps(i4,d0)), w));
+        _mm_storeu_ps(v+i, _mm_mul_ps(_mm_add_ps(a1, _mm_mul_ps(i4,d1)), w));
+    }
+    for(; i<n; i++) {
+        const float w = 1/(a[2]+i*d[2]);
+        u[i] = (a[0]+i*d[0])*w;
+        v[i] = (a[1]+i*d[1])*w;
+    }
+}
+
+__attribute__((target("avx")))
+inline void projectAVX(const float a[3], const float d[3], int n,
+                       float* u, float* v) {
+    const __m256 one=_mm256_set1_ps(1), eight=_mm256_set1_ps(8);
+    const __m256 a0=_mm256_set1_ps(a[0]), a1=_mm256_set1_ps(a[1]),
+                 a2=_mm256_set1_ps(a[2]);
+    const __m256 d0=_mm256_set1_ps(d[0]), d1=_mm256_set1_ps(d[1]),
+                 d2=_mm256_set1_ps(d[2]);
+    __m256 i8 = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+    int i=0;
+    for(; i+8<=n; i+=8, i8=_mm256_add_ps(i8,eight)) {
+        const __m256 w = _mm256_div_ps(one,
+                                       _mm256_add_ps(a2, _mm256_mul_ps(i8,d2)));
+        _mm256_storeu_ps(u+i, _mm256_mul_ps(
+                             _mm256_add_ps(a0, _mm256_mul_ps(i8,d0)), w));
+        _mm256_storeu_ps(v+i, _mm256_mul_ps(
+                             _mm256_add_ps(a1, _mm256_mul_ps(i8,d1)), w));
+    }
+    for(; i<n; i++) {
+        const float w = 1/(a[2]+i*d[2]);
+        u[i] = (a[0]+i*d[0])*w;
+        v[i] = (a[1]+i*d[1])*w;
+    }
+}
+#endif
+
+/// Best projection kernel for this CPU
+inline ProjectKernel projectKernel() {
+#ifdef WARP_X86
+    if(__builtin_cpu_supports("avx"))
+        return projectAVX;
+    if(__builtin_cpu_supports("sse2"))
+        return projectSSE;
+#endif
+    return projectScalar;
+}
+
+/// Color of I at (u,v), bilinearly interpolated with 8-bit weights. The point
+/// must be in [0,w)x[0,h); the last row and column are extended.
+inline Color sample(const Imagine::Image<Color>& I, float u, float v) {
+    const int w=I.width(), h=I.height();
+    const int x=int(u), y=int(v);
+    const int wx=int((u-x)*256), wy=int((v-y)*256);
+    const Color* p = I.data()+x+w*y;
+    const int dx = (x+1<w)? 1: 0, dy = (y+1<h)? w: 0;
+    Color c;
+    for(int k=0; k<3; k++) {
+        const int top = p[0][k]*(256-wx) + p[dx][k]*wx;
+        const int bottom = p[dy][k]*(256-wx) + p[dy+dx][k]*wx;
+        c[k] = byte((top*(256-wy) + bottom*wy + (1<<15)) >> 16);
+    }
+    return c;
+}
+
+/// Scratch buffers of warpRow
+struct RowBuffer {
+    std::vector<float> u, v;
+};
+
+/// Warp pixels x0..x0+n-1 of row y: out[i] is the color of I at H(x0+i,y),
+/// in[i] is 1 if this point is inside I, 0 otherwise. H is given by rows. If
+/// weight is not null, weight[i] is the feathering weight of the point (see
+/// Blend.h), 0 outside I.
+inline void warpRow(const Imagine::Image<Color>& I, const double H[9],
+                    int x0, int y, int n, RowBuffer& buf,
+                    Color* out, byte* in, float* weight=0) {
+    static const ProjectKernel project = projectKernel();
+    if(int(buf.u.size()) < n) {
+        buf.u.resize(n);
+        buf.v.resize(n);
+    }
+    float a[3], d[3];
+    for(int k=0; k<3; k++) {
+        a[k] = float(H[3*k]*x0 + H[3*k+1]*y + H[3*k+2]);
+        d[k] = float(H[3*k]);
+    }
+    project(a, d, n, &buf.u[0], &buf.v[0]);
+    const float w=float(I.width()), h=float(I.height());
+    for(int i=0; i<n; i++) {
+        const float u=buf.u[i], v=buf.v[i];
+        in[i] = (u>=0 && u<w && v>=0 && v<h);
+        if(in[i])
+            out[i] = sample(I, u, v);
+        if(weight)
+            weight[i] = in[i]? Blend::borderWeight(u,v,I.width(),I.height()): 0;
+    }
+}
+
+} // namespace Warp
+
+#endif